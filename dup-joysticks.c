@@ -22,7 +22,7 @@
  * SOFTWARE.
  */
 
-// gcc -o dup-joysticks dup-joysticks.c -ludev
+// gcc -o dup-joysticks dup-joysticks.c -ludev -lpthread
 
 /*
  * Creates duplicate passthrough joystick nodes in /dev/input/ for each real joystick.
@@ -42,310 +42,5028 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <linux/uinput.h>
 #include <linux/joystick.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#define MAX_EVENTS 10
 #define MAX_JOYSTICKS 10
-#define MAX_FF_EFFECTS 16
+/* Every fd of the main loop: js and tick fds of each slot, plus hotplug and signals */
+#define MAIN_EVENTS (MAX_JOYSTICKS * 2 + 4)
+/* Largest js read from one device, see cfg.js_budget */
+#define JS_BATCH 64
+#define STAGE_MAX 64
+#define KEY_STAGE_MAX 32
+#define MAX_SINKS 4
+#define MAX_MEMBERS 4
+/* USB id of the virtual devices this daemon creates */
+#define OUTPUT_VENDOR 0x776C
+#define OUTPUT_PRODUCT 0x6A73
 #define BITS_TO_LONGS(x) \
         (((x) + 8 * sizeof (unsigned long) - 1) / (8 * sizeof (unsigned long)))
 
+/*
+ * Noise floor estimation. Only motion within NOISE_REST_WINDOW of the value
+ * the axis reported when it was opened is estimated and filtered: there a
+ * delta smaller than NOISE_DELTA_CAP that reverses direction is treated as
+ * jitter. The estimate rises quickly and decays slowly. A value held back
+ * by the band is forwarded anyway after NOISE_HOLD_MS, so the output never
+ * stays stale. Values are in joydev units (-32767..32767).
+ */
+#define NOISE_DELTA_CAP 640
+#define NOISE_REST_WINDOW 1024
+#define NOISE_HOLD_MS 50
+#define NOISE_RISE_SHIFT 2
+#define NOISE_DECAY_SHIFT 6
+#define AXIS_MAX 32767
+
 static int epollfd;
+static int hotplug_timer_fd = -1;
 static struct udev *udev;
 static struct epoll_event ev;
 
+static struct {
+	int noise_filter;
+	int noise_band;		/* hysteresis band, percent of the learned floor */
+	int settle_ms;		/* quiet time before a hotplugged pair is attached */
+	int persist_ms;		/* grace period for disconnected virtual devices */
+	int pool_size;		/* pre-created uinput devices */
+	int ff_rate_hz;		/* force feedback flushes per second, 0 forwards at once */
+	int ff_effects;		/* effect slots advertised by devices with force feedback */
+	int ff_soft_timing;	/* play all effects of rumble devices in software */
+	int sinks;		/* virtual devices fed by each controller */
+	int ff_arbitration;	/* how effects of several sinks share the motors */
+	int js_budget;		/* js events read from one device per main loop pass */
+	const char *allow_name;	/* a virtual source to duplicate anyway, by name */
+	int allow_vendor, allow_product;	/* or by id, -1 if not set */
+} cfg = {
+	.noise_filter = 1,
+	.noise_band = 150,
+	.settle_ms = 200,
+	.ff_rate_hz = 100,
+	.ff_effects = 16,
+	.sinks = 1,
+	.js_budget = JS_BATCH,
+	.allow_vendor = -1,
+	.allow_product = -1,
+};
+
+enum ff_arbitration {
+	FF_ARB_PRIORITY,	/* a lower numbered sink silences the others */
+	FF_ARB_MIX,		/* effects of all sinks play together */
+	FF_ARB_LAST,		/* the sink that played last owns the motors */
+};
+
+struct axis_noise {
+	int rest;		/* value at open, see JS_EVENT_INIT */
+	int last_raw;
+	int last_delta;
+	int out;		/* last value forwarded */
+	unsigned int floor_q8;	/* learned noise amplitude, 24.8 fixed point */
+	unsigned long events_in, events_out;
+};
+
+/*
+ * Everything add_joystick() learns from the joydev and evdev nodes. The
+ * layout is fixed so records can be stored as-is in the capability cache.
+ */
+struct js_caps {
+	struct input_id id;
+	uint32_t name_hash;
+	uint8_t axes;
+	uint8_t buttons;
+	uint8_t has_ff;
+	uint8_t pad;
+	int32_t ff_effects_max;
+	uint16_t btnmap[KEY_MAX - BTN_MISC + 1];
+	uint8_t axmap[ABS_MAX + 1];
+	unsigned char key_bits[KEY_MAX / 8 + 1];
+	unsigned long abs_bits[BITS_TO_LONGS(ABS_CNT)];
+	unsigned long ff_bits[BITS_TO_LONGS(FF_CNT)];
+};
+
+/*
+ * Force feedback effects uploaded to the virtual device keep their virtual
+ * id; the table maps it to the id the physical device assigned. Updates of
+ * a known effect are uploaded in place, and plays and erases are translated.
+ * The effect itself is kept so it can be uploaded again after a rebind.
+ * With a rate limit, updates and plays of an uploaded effect only record
+ * the latest state and are flushed to the device at most cfg.ff_rate_hz
+ * times per second. The table can be larger than the device's own effect
+ * memory: effects are paged into the physical slots when played, evicting
+ * the least recently used one.
+ */
+struct ff_slot {
+	int16_t phys;		/* physical effect id, -1 if not uploaded */
+	uint8_t valid;		/* the consumer has uploaded this virtual id */
+	uint8_t dirty;		/* effect changed since the last upload */
+	uint8_t play_pending;
+	int32_t play_value;
+	uint64_t play_queued_us;	/* first coalesced play since the last flush */
+	uint8_t sink;		/* virtual device the effect was uploaded to */
+	uint64_t play_end_us;	/* when the last play ends, 0 if stopped */
+	unsigned long last_used;
+	/* Software playback, see ff_soft() */
+	uint8_t soft;
+	uint8_t soft_playing;	/* the device is rumbling for this effect */
+	int soft_repeat;
+	unsigned int soft_seq;	/* bumped to cancel the armed timer */
+	int soft_strong, soft_weak;
+	uint64_t soft_start_us;
+	struct wheel_timer *soft_timer;
+	struct ff_effect effect;
+};
+
+/* Log-linear latency histogram: four buckets per power of two microseconds */
+#define HIST_BUCKETS 96
+
+struct hist {
+	unsigned long count;
+	unsigned long bucket[HIST_BUCKETS];
+};
+
+/* Round trip of one kind of consumer request to the physical device */
+struct ff_op {
+	struct hist rt;
+	unsigned long ioctls;	/* physical ioctls and writes */
+};
+
+struct ff_stats {
+	unsigned long uploads, updates, erases, plays, ioctls, writes;
+	unsigned long superseded_updates, superseded_plays;
+	unsigned long misses, evictions;	/* plays of paged out effects */
+	uint64_t page_in_us;
+	unsigned long soft_updates;	/* magnitude updates of emulated effects */
+	struct ff_op op_upload, op_erase, op_play;
+	unsigned long sink_requests[MAX_SINKS];
+	unsigned long sink_denied[MAX_SINKS];	/* plays refused by arbitration */
+	unsigned long sink_preempted[MAX_SINKS];	/* effects stopped for another sink */
+	uint64_t upload_us;
+	uint64_t max_us;	/* longest single request */
+};
+
+enum js_state {
+	JS_FREE,
+	JS_PROBING,	/* owned by the attach worker */
+	JS_CREATING,	/* owned by the attach worker */
+	JS_ACTIVE,
+	JS_DETACHED,	/* virtual device kept alive without a physical one */
+	JS_POOL_CREATING,	/* owned by the attach worker */
+	JS_POOLED,	/* created ahead of time, waiting for a controller */
+	JS_MEMBER,	/* probed composite member, waiting for the others */
+};
+
+/*
+ * Per-device state is split in two. struct joystick holds what the main
+ * loop touches for every input event, with the scalars in the first cache
+ * line and the axis, button and noise state inline after it. Everything
+ * else, including the force feedback state the FF thread writes, lives in
+ * struct joystick_cold so it neither dilutes the hot lines nor shares them
+ * with another thread.
+ */
+#define JS_MAX_BUTTONS 256	/* joydev reports the count in a byte */
+#define BUTTON_WORDS (JS_MAX_BUTTONS / 64)
+#define KEY_WORDS ((KEY_CNT + 63) / 64)
+
+struct joystick_cold;
+
 struct joystick {
+	int state;
 	int fd;
+	unsigned char axes;
+	unsigned char buttons;
+	int staged;
+	/* Sink 0 is "Wayland Joystick N", further sinks receive the same frames */
+	int sinks;
+	int uinput_fd[MAX_SINKS];
+	struct transform *xform;
+	struct remap *remap;
+	/* Output clock, see stage_put() */
+	int out_hz;		/* frames per second, 0 writes a frame per event */
+	int key_staged;
+	/* Second cache line */
+	struct composite *composite;
+	struct predictor *predict;
+	struct joystick_cold *cold;
+	int tick_armed;
+	int tick_fd;
+	int member;		/* position in the composite */
+	uint64_t key_since_us, abs_since_us;	/* wakeup that staged the first event */
+	uint64_t noise_held;	/* axes whose latest value the noise filter held back */
+	uint64_t noise_due_us;	/* when held values are forwarded anyway */
+	unsigned long sink_frames[MAX_SINKS];
+	int axis[ABS_CNT];
+	/* Filtered input and last output of the transform, see axis_kernel() */
+	int32_t axis_in[ABS_CNT];
+	int32_t axis_out[ABS_CNT];
+	uint64_t button[BUTTON_WORDS];	/* one bit per button */
+	struct axis_noise noise[ABS_CNT];
+	struct input_event key_stage[KEY_STAGE_MAX];	/* buttons, written at once */
+	struct input_event stage[STAGE_MAX];		/* axes, paced by the clock */
+} __attribute__((aligned(64)));
+
+struct joystick_cold {
+	int remove_pending;
+	uint64_t attach_start_us;	/* first udev add event of the device */
+	struct profile_set *attach_profiles;
+	uint64_t detach_deadline_us;
+	char *last_id_path;
 	int event_fd;
-	int uinput_fd;
-	char *id_path, *event_id_path;
+	char *id_path;
 	char *node_name, *event_node_name;
 	mode_t orig_mode, event_orig_mode;
-	unsigned char axes;
-	unsigned char buttons;
-	int *axis;
-	char *button;
-	uint16_t btnmap[KEY_MAX - BTN_MISC + 1];
-	uint8_t axmap[ABS_MAX + 1];
+	int rest[ABS_CNT];
+	struct js_caps caps;
+	/* Output codes set at UI_DEV_CREATE, the kernel drops any other */
+	uint64_t adv_keys[KEY_WORDS];
+	uint64_t adv_abs;
+	unsigned long out_coalesced;
+	unsigned long out_key_frames;	/* button frames written between ticks */
+	unsigned long in_reads, in_events;
+	unsigned long in_throttled;	/* reads that used up the budget */
 	struct ff_effect rumble_effect;
+	int ff_slots;		/* table entries, ff_per_sink for each sink */
+	int ff_per_sink;
+	int ff_resident;	/* effects holding a physical slot */
+	unsigned long ff_clock;
+	unsigned int ff_gen;	/* bumped when the table is freed */
+	struct ff_slot *ff;
+	struct ff_stats ff_stats;
+	pthread_mutex_t ff_lock;
+	atomic_int ff_work;
+	int ff_pending;		/* coalesced updates or plays wait for a flush */
+	uint64_t ff_flush_us;	/* last flush to the physical device */
+} __attribute__((aligned(64)));
+
+/*
+ * A composite device merges the controllers of every profile naming it into
+ * one virtual device, owned by the slot of the first member. It is created
+ * once all members are present. Member 0 keeps its codes; buttons and axes
+ * of later members that collide are moved to free codes, which stay with
+ * the position so a member reconnecting later reuses them.
+ */
+struct composite {
+	char *name;
+	int members;
+	int owner;		/* slot holding the virtual device, -1 until created */
+	int slot[MAX_MEMBERS];	/* attached member slots, -1 if absent */
+	int pending;		/* events staged during this main loop pass */
+	unsigned long frames;
+	struct js_caps caps[MAX_MEMBERS];
+	uint16_t key_out[MAX_MEMBERS][KEY_MAX - BTN_MISC + 1];
+	uint8_t abs_out[MAX_MEMBERS][ABS_CNT];	/* ABS_CNT if no free code was left */
+};
+
+static struct composite *composites[MAX_JOYSTICKS];
+
+struct latency {
+	unsigned long count;
+	uint64_t total_us, max_us;
+};
+
+/* Attach latencies run from the device's first udev add event */
+static struct {
+	struct latency settle;	/* part of it spent in the settle window */
+	struct latency created;	/* new uinput device */
+	struct latency pooled;	/* bound to a warm pool device */
+	struct latency rebound;	/* bound to a detached device */
+	uint64_t max_stall_us;	/* longest main loop pass spent on hotplug */
+} attach_stats;
+
+/* Time from the main loop waking up until a js event was forwarded */
+static struct latency input_latency;
+
+static void latency_add(struct latency *l, uint64_t us)
+{
+	l->count++;
+	l->total_us += us;
+	if (us > l->max_us)
+		l->max_us = us;
+}
+
+static void latency_print(const char *what, const struct latency *l)
+{
+	if (l->count)
+		printf("%s: %lu, %lu us average, %lu us max\n", what, l->count,
+			(unsigned long) (l->total_us / l->count), (unsigned long) l->max_us);
+}
+
+static int hist_index(uint64_t us)
+{
+	int msb, idx;
+
+	if (us < 4)
+		return us;
+	msb = 63 - __builtin_clzll(us);
+	idx = 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/* Smallest value that falls into a bucket */
+static uint64_t hist_value(int idx)
+{
+	if (idx < 4)
+		return idx;
+	return (uint64_t) (4 + idx % 4) << (idx / 4 - 1);
+}
+
+static void hist_add(struct hist *h, uint64_t us)
+{
+	h->count++;
+	h->bucket[hist_index(us)]++;
+}
+
+/* Upper bound of the bucket holding the given percentile */
+static uint64_t hist_percentile(const struct hist *h, int pct)
+{
+	unsigned long want = (h->count * pct + 99) / 100, seen = 0;
+
+	for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			return hist_value(i + 1) - 1;
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+static void hist_print(const char *what, const struct hist *h)
+{
+	if (h->count)
+		printf("%s: %lu, p50 %lu us, p99 %lu us\n", what, h->count,
+			(unsigned long) hist_percentile(h, 50), (unsigned long) hist_percentile(h, 99));
+}
+
+static void ff_op_print(const char *what, const struct ff_op *op)
+{
+	if (!op->rt.count)
+		return;
+	printf("   %s round trip: %lu, p50 %lu us, p90 %lu us, p99 %lu us, %lu.%02lu device calls each\n",
+		what, op->rt.count, (unsigned long) hist_percentile(&op->rt, 50),
+		(unsigned long) hist_percentile(&op->rt, 90), (unsigned long) hist_percentile(&op->rt, 99),
+		op->ioctls / op->rt.count, op->ioctls * 100 / op->rt.count % 100);
+}
+
+/*
+ * Per-device memory is carved from one arena mapped at startup, so the
+ * attach, reconnect and detach cycles of a long-running daemon never reach
+ * malloc. Each kind of object has a pool of fixed-size blocks, sized for
+ * its largest instance and counted for every slot; freed blocks go back on
+ * the pool's free list for the next device. See arena_init() for the sizes.
+ */
+enum arena_kind {
+	ARENA_STRING,		/* node names, paths and hotplug keys */
+	ARENA_TRANSFORM,
+	ARENA_REMAP,
+	ARENA_PREDICTOR,
+	ARENA_FF,		/* force feedback slot tables */
+	ARENA_COMPOSITE,
+	ARENA_KINDS
 };
 
+#define ARENA_STRING_MAX 512
+
+struct arena_pool {
+	const char *name;
+	size_t size;		/* block size */
+	int count;
+	int used, peak;
+	unsigned long allocs, failures;
+	char *base;
+	void *free_list;
+};
+
+static struct arena_pool arena[ARENA_KINDS];
+static size_t arena_bytes;
+/* The attach worker allocates too */
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns a zeroed block, or NULL once the pool is exhausted */
+static void *arena_alloc(enum arena_kind kind)
+{
+	struct arena_pool *ap = &arena[kind];
+	void *block;
+
+	pthread_mutex_lock(&arena_lock);
+	block = ap->free_list;
+	if (block) {
+		ap->free_list = *(void **) block;
+		ap->allocs++;
+		if (++ap->used > ap->peak)
+			ap->peak = ap->used;
+	} else {
+		ap->failures++;
+	}
+	pthread_mutex_unlock(&arena_lock);
+	if (block)
+		memset(block, 0, ap->size);
+	else
+		printf("Arena: out of %s blocks\n", ap->name);
+	return block;
+}
+
+static void arena_free(void *block)
+{
+	if (!block)
+		return;
+	for (int k = 0; k < ARENA_KINDS; k++) {
+		struct arena_pool *ap = &arena[k];
+		if ((char *) block < ap->base || (char *) block >= ap->base + ap->size * ap->count)
+			continue;
+		pthread_mutex_lock(&arena_lock);
+		*(void **) block = ap->free_list;
+		ap->free_list = block;
+		ap->used--;
+		pthread_mutex_unlock(&arena_lock);
+		return;
+	}
+}
+
+static char *arena_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *copy;
+
+	if (len > ARENA_STRING_MAX) {
+		printf("Arena: %zu byte name does not fit\n", len);
+		return NULL;
+	}
+	copy = arena_alloc(ARENA_STRING);
+	if (copy)
+		memcpy(copy, s, len);
+	return copy;
+}
+
 static int num_josyticks = 0;
 static struct joystick joysticks[MAX_JOYSTICKS];
+static struct joystick_cold joystick_cold[MAX_JOYSTICKS];
+
+/* Time from a main loop wakeup until its events were written, per lane */
+static uint64_t loop_wake_us;
+static struct hist key_latency, abs_latency;
 
-static void emit(int fd, int type, int code, int val)
+static uint64_t now_us(void);
+
+/*
+ * Writes the staged buttons, and with axes set the staged axis values too,
+ * as one frame to every sink.
+ */
+static void write_frame(struct joystick *js_dev, int axes)
 {
-	struct input_event ie;
+	static const struct input_event syn = { .type = EV_SYN, .code = SYN_REPORT };
+	int abs_staged = axes ? js_dev->staged : 0;
+	struct iovec iov[3] = {
+		{ js_dev->key_stage, js_dev->key_staged * sizeof(struct input_event) },
+		{ js_dev->stage, abs_staged * sizeof(struct input_event) },
+		{ (void *) &syn, sizeof(syn) },
+	};
+	uint64_t now;
 
-	ie.type = type;
-	ie.code = code;
-	ie.value = val;
-	/* timestamp values below are ignored */
-	ie.time.tv_sec = 0;
-	ie.time.tv_usec = 0;
+	if (!js_dev->key_staged && !abs_staged) {
+		return;
+	}
+	/* timestamp values are ignored */
+	for (int i = 0; i < js_dev->sinks; i++) {
+		writev(js_dev->uinput_fd[i], iov, 3);
+		js_dev->sink_frames[i]++;
+	}
+	now = now_us();
+	if (js_dev->key_staged)
+		hist_add(&key_latency, now - js_dev->key_since_us);
+	if (abs_staged)
+		hist_add(&abs_latency, now - js_dev->abs_since_us);
+	js_dev->key_staged = 0;
+	if (axes)
+		js_dev->staged = 0;
+}
 
-	write(fd, &ie, sizeof(ie));
+static void flush_events(struct joystick *js_dev);
+
+/*
+ * Output is staged in two lanes. Button events never wait: frame_ready()
+ * writes them as soon as the events of a read are staged, and a second
+ * transition of a staged button first writes the one before it, so a press
+ * and release are never merged. Axis values wait for the output clock when
+ * the device has a rate, a newer value replacing the staged one; the first
+ * frame after an idle tick is written at once and starts the clock again.
+ */
+static void stage_put(struct joystick *js_dev, const struct input_event *ie)
+{
+	if (ie->type == EV_KEY) {
+		int i;
+		for (i = 0; i < js_dev->key_staged; i++) {
+			if (js_dev->key_stage[i].code == ie->code)
+				break;
+		}
+		if (i < js_dev->key_staged || js_dev->key_staged == KEY_STAGE_MAX) {
+			flush_events(js_dev);
+			/* A composite owner leaves the frame to composite_flush() */
+			if (js_dev->key_staged)
+				write_frame(js_dev, 0);
+		}
+		if (!js_dev->key_staged)
+			js_dev->key_since_us = loop_wake_us;
+		js_dev->key_stage[js_dev->key_staged++] = *ie;
+		return;
+	}
+	for (int i = js_dev->staged - 1; js_dev->out_hz && i >= 0; i--) {
+		struct input_event *staged = &js_dev->stage[i];
+		if (staged->type != ie->type || staged->code != ie->code)
+			continue;
+		staged->value = ie->value;
+		js_dev->cold->out_coalesced++;
+		return;
+	}
+	if (js_dev->staged == STAGE_MAX) {
+		flush_events(js_dev);
+		if (js_dev->staged == STAGE_MAX)
+			write_frame(js_dev, 1);
+	}
+	if (!js_dev->staged)
+		js_dev->abs_since_us = loop_wake_us;
+	js_dev->stage[js_dev->staged++] = *ie;
 }
 
-static void add_joystick(struct udev_device *dev)
+static void tick_fd_open(struct joystick *js_dev)
+{
+	if (js_dev->tick_fd < 0) {
+		js_dev->tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		ev.events = EPOLLIN;
+		ev.data.fd = js_dev->tick_fd;
+
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, js_dev->tick_fd, &ev) == -1) {
+			printf("epoll_ctl: Failed to add output clock\n");
+		}
+	}
+}
+
+static void tick_arm(struct joystick *js_dev, int on)
+{
+	struct itimerspec its;
+
+	tick_fd_open(js_dev);
+	memset(&its, 0, sizeof(its));
+	if (on && js_dev->out_hz) {
+		uint64_t period_ns = 1000000000ULL / js_dev->out_hz;
+		its.it_interval.tv_sec = period_ns / 1000000000;
+		its.it_interval.tv_nsec = period_ns % 1000000000;
+		its.it_value = its.it_interval;
+	}
+	js_dev->tick_armed = on && js_dev->out_hz;
+	if (timerfd_settime(js_dev->tick_fd, 0, &its, NULL) == -1) {
+		/* Without a clock, frames are written as they are staged */
+		printf("Output clock of %d Hz failed: %s, writing frames unpaced\n", js_dev->out_hz, strerror(errno));
+		js_dev->tick_armed = 0;
+		js_dev->out_hz = 0;
+	}
+}
+
+/* A single expiration, for devices whose clock is not running */
+static void tick_once(struct joystick *js_dev, uint64_t delay_us)
+{
+	struct itimerspec its;
+
+	tick_fd_open(js_dev);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = delay_us / 1000000;
+	its.it_value.tv_nsec = delay_us % 1000000 * 1000 + 1;
+	timerfd_settime(js_dev->tick_fd, 0, &its, NULL);
+}
+
+static void predictor_settle(struct joystick *js_dev);
+static void noise_settle(struct joystick *js_dev);
+static void settle_wait(struct joystick *js_dev);
+
+/* Writes the staged buttons now, and the axes too unless the clock is running */
+static void frame_ready(struct joystick *js_dev)
 {
-	if (num_josyticks >= MAX_JOYSTICKS) {
-		printf("10 joysticks maximum\n");
+	int axes = js_dev->staged;
+
+	if (js_dev->tick_armed) {
+		if (js_dev->key_staged)
+			js_dev->cold->out_key_frames++;
+		write_frame(js_dev, 0);
 		return;
 	}
+	write_frame(js_dev, 1);
+	if (axes && js_dev->out_hz) {
+		tick_arm(js_dev, 1);
+	}
+}
 
-	const char *device_node_name = udev_device_get_devnode(dev);
-	if (!device_node_name)
-	{
+/* Runs on each expiration of the output clock */
+static void output_tick(struct joystick *js_dev)
+{
+	predictor_settle(js_dev);
+	noise_settle(js_dev);
+	if (!js_dev->staged) {
+		tick_arm(js_dev, 0);
+		settle_wait(js_dev);
 		return;
 	}
-	printf("Device Node Path: %s\n", device_node_name);
-	int js_slot;
-	struct joystick *js_dev = NULL;
-	struct udev_list_entry *properties = udev_device_get_properties_list_entry(dev);
-	while (properties) {
-		const char *property_name = udev_list_entry_get_name(properties);
-		const char *property_value = udev_list_entry_get_value(properties);
-		if (strcmp(property_name, "ID_VENDOR_ID") && strcmp(property_name, "ID_MODEL_ID") &&
-			strcmp(property_name, "DEVNAME") && strcmp(property_name, "ID_MODEL") &&
-			strcmp(property_name, "ID_PATH")) {
-			properties = udev_list_entry_get_next(properties);
-			continue;
+	write_frame(js_dev, 1);
+	if (!js_dev->out_hz) {
+		/* The rate was removed by a reload */
+		tick_arm(js_dev, 0);
+	}
+}
+
+/*
+ * Members of a composite hand their events to the owner's stage, and
+ * composite_flush() writes everything staged during one main loop pass as
+ * a single frame.
+ */
+static void flush_events(struct joystick *js_dev)
+{
+	struct composite *c = js_dev->composite;
+	struct joystick *owner;
+
+	if (!c || c->owner < 0) {
+		frame_ready(js_dev);
+		return;
+	}
+	owner = &joysticks[c->owner];
+	if (owner != js_dev) {
+		for (int i = 0; i < js_dev->key_staged; i++)
+			stage_put(owner, &js_dev->key_stage[i]);
+		for (int i = 0; i < js_dev->staged; i++)
+			stage_put(owner, &js_dev->stage[i]);
+		js_dev->key_staged = js_dev->staged = 0;
+	}
+	c->pending = 1;
+}
+
+static void composite_flush(void)
+{
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		struct composite *c = composites[i];
+		if (c && c->pending) {
+			c->pending = 0;
+			if (joysticks[c->owner].staged || joysticks[c->owner].key_staged)
+				c->frames++;
+			frame_ready(&joysticks[c->owner]);
 		}
-		if (!strcmp(property_name, "ID_PATH")) {
-			if (!strncmp(device_node_name, "/dev/input/js", strlen("/dev/input/js"))) {
-				for (int i = 0; i <= MAX_JOYSTICKS; i++) {
-					if (!joysticks[i].node_name && !joysticks[i].event_node_name) {
-						joysticks[i].node_name = strdup(device_node_name);
-						joysticks[i].id_path = strdup(property_value);
-						return;
-					} else if (joysticks[i].event_node_name && !strcmp(joysticks[i].event_id_path, property_value)) {
-						joysticks[i].node_name = strdup(device_node_name);
-						joysticks[i].id_path = strdup(property_value);
-						js_dev = &joysticks[i];
-						js_slot = i;
-						break;
-					}
-				}
-			} else if (!strncmp(device_node_name, "/dev/input/event", strlen("/dev/input/event"))) {
-				for (int i = 0; i <= MAX_JOYSTICKS; i++) {
-					if (!joysticks[i].event_node_name && !joysticks[i].node_name) {
-						joysticks[i].event_node_name = strdup(device_node_name);
-						joysticks[i].event_id_path = strdup(property_value);
-						return;
-					} else if (joysticks[i].node_name && !strcmp(joysticks[i].id_path, property_value)) {
-						joysticks[i].event_node_name = strdup(device_node_name);
-						joysticks[i].event_id_path = strdup(property_value);
-						js_dev = &joysticks[i];
-						js_slot = i;
-						break;
+	}
+}
+
+static uint32_t hash_str(const char *s)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*s)
+		hash = (hash ^ (unsigned char) *s++) * 16777619u;
+	return hash;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t input_event_us(const struct input_event *ie)
+{
+	return (uint64_t) ie->input_event_sec * 1000000 + ie->input_event_usec;
+}
+
+/*
+ * Updates the noise estimate of an axis and decides whether the new value
+ * moved far enough from the last forwarded one to be worth an event.
+ */
+static int axis_noise_filter(struct axis_noise *n, int value, int init)
+{
+	int delta = value - n->last_raw;
+	int mag = abs(delta);
+
+	n->events_in++;
+	if (init)
+		n->rest = value;
+	if (!init && mag && mag < NOISE_DELTA_CAP && (delta ^ n->last_delta) < 0 &&
+		abs(value - n->rest) <= NOISE_REST_WINDOW && abs(n->last_raw - n->rest) <= NOISE_REST_WINDOW) {
+		unsigned int sample = mag << 8;
+		if (sample > n->floor_q8)
+			n->floor_q8 += (sample - n->floor_q8) >> NOISE_RISE_SHIFT;
+		else
+			n->floor_q8 -= (n->floor_q8 - sample) >> NOISE_DECAY_SHIFT;
+	} else if (mag >= NOISE_DELTA_CAP) {
+		n->floor_q8 -= n->floor_q8 >> NOISE_DECAY_SHIFT;
+	}
+	if (mag)
+		n->last_delta = delta;
+	n->last_raw = value;
+
+	/* Away from rest every move is deliberate */
+	if (cfg.noise_filter && !init && value && abs(value) != AXIS_MAX &&
+		abs(value - n->rest) <= NOISE_REST_WINDOW && abs(n->out - n->rest) <= NOISE_REST_WINDOW) {
+		unsigned int band = (n->floor_q8 >> 8) * cfg.noise_band / 100;
+		if ((unsigned int) abs(value - n->out) <= band)
+			return 0;
+	}
+	n->out = value;
+	n->events_out++;
+	return 1;
+}
+
+/*
+ * Per-device profiles are read from the file given with -c and reloaded on
+ * SIGHUP. Every directive belongs to a [profile] section, which may carry
+ * match lines and per-axis directives:
+ *
+ *	[profile pad]
+ *	match usb 045e:028e
+ *	match path pci-0000:00:14.0-usb-0:2:1.0
+ *	axis 0 deadzone 3000 curve expo 40
+ *	axis 1 deadzone 3000 curve expo 40 invert
+ *	axis 2 curve piecewise -32767:-32767 0:0 16000:8000 32767:32767
+ *	axis 5 curve custom -32767 -20000 0 32767
+ *	axis 3 smooth 40 10 predict 8
+ *	map button 0 key BTN_EAST
+ *	map button 4 abs ABS_HAT0X -32767
+ *	map axis 3 abs ABS_RX
+ *	map axis 2 key BTN_TL2 above 16000
+ *	map chord 6+7 key BTN_MODE
+ *	rate 240
+ *
+ * The first profile whose match lines fit the device is used; a profile
+ * without match lines fits every device. Axis and button numbers are joydev
+ * indices; output codes are evdev codes given by name or number. A rate
+ * line sets a fixed output frame rate for the axes of the virtual device;
+ * button events are written without waiting for it. Smoothing
+ * takes the alpha and beta gains of the axis filter in percent, and
+ * predict extrapolates the axis that many milliseconds ahead.
+ *
+ * Profiles sharing a "composite NAME" line feed one virtual controller, in
+ * the order the profiles appear; see struct composite. Composites that
+ * already exist keep their members across a reload.
+ */
+#define CURVE_MAX_POINTS 16
+#define PREDICT_MAX_MS 50
+#define PROFILE_MAX_MAPS 64
+
+enum curve_type {
+	CURVE_LINEAR,
+	CURVE_EXPO,
+	CURVE_PIECEWISE,
+	CURVE_CUSTOM,
+};
+
+struct axis_config {
+	int set;
+	int deadzone;
+	int invert;
+	enum curve_type curve;
+	int expo;		/* percent of cubic in the expo curve */
+	int smooth_alpha, smooth_beta;	/* percent, 0 if not smoothed */
+	int predict_ms;
+	int points;
+	int in[CURVE_MAX_POINTS], out[CURVE_MAX_POINTS];
+	int16_t *lut;		/* curved axes, built once per configuration */
+};
+
+enum remap_kind {
+	REMAP_KEY,		/* button -> key, value passed through */
+	REMAP_ABS,		/* axis -> abs, value passed through */
+	REMAP_AXIS_KEY,		/* axis -> key, pressed past a threshold */
+	REMAP_BUTTON_ABS,	/* button -> abs, fixed value while pressed */
+	REMAP_CHORD,		/* button is part of a chord */
+};
+
+struct map_rule {
+	int kind;
+	int src;
+	uint64_t chord;
+	int code;
+	int param;
+	int below;
+};
+
+struct profile {
+	char *name;
+	int match_usb;
+	unsigned short vendor, product;
+	char *match_path;
+	char *composite;
+	int rate_hz;
+	struct axis_config axis[ABS_CNT];
+	int maps;
+	struct map_rule map[PROFILE_MAX_MAPS];
+	struct profile *next;
+};
+
+#define CODE(c) { #c, c }
+static const struct {
+	const char *name;
+	int code;
+} code_names[] = {
+	CODE(BTN_TRIGGER), CODE(BTN_THUMB), CODE(BTN_THUMB2), CODE(BTN_TOP),
+	CODE(BTN_TOP2), CODE(BTN_PINKIE), CODE(BTN_BASE), CODE(BTN_BASE2),
+	CODE(BTN_BASE3), CODE(BTN_BASE4), CODE(BTN_BASE5), CODE(BTN_BASE6),
+	CODE(BTN_SOUTH), CODE(BTN_EAST), CODE(BTN_C), CODE(BTN_NORTH),
+	CODE(BTN_WEST), CODE(BTN_Z), CODE(BTN_TL), CODE(BTN_TR),
+	CODE(BTN_TL2), CODE(BTN_TR2), CODE(BTN_SELECT), CODE(BTN_START),
+	CODE(BTN_MODE), CODE(BTN_THUMBL), CODE(BTN_THUMBR),
+	CODE(BTN_DPAD_UP), CODE(BTN_DPAD_DOWN), CODE(BTN_DPAD_LEFT), CODE(BTN_DPAD_RIGHT),
+	CODE(ABS_X), CODE(ABS_Y), CODE(ABS_Z), CODE(ABS_RX), CODE(ABS_RY), CODE(ABS_RZ),
+	CODE(ABS_THROTTLE), CODE(ABS_RUDDER), CODE(ABS_WHEEL), CODE(ABS_GAS), CODE(ABS_BRAKE),
+	CODE(ABS_HAT0X), CODE(ABS_HAT0Y), CODE(ABS_HAT1X), CODE(ABS_HAT1Y),
+	CODE(ABS_HAT2X), CODE(ABS_HAT2Y), CODE(ABS_HAT3X), CODE(ABS_HAT3Y),
+};
+#undef CODE
+
+static int parse_code(const char *s, int max)
+{
+	char *end;
+	long code = strtol(s, &end, 0);
+
+	if (*end) {
+		code = -1;
+		for (size_t i = 0; i < sizeof(code_names) / sizeof(code_names[0]); i++) {
+			if (!strcmp(s, code_names[i].name)) {
+				code = code_names[i].code;
+				break;
+			}
+		}
+	}
+	return code >= 0 && code <= max ? code : -1;
+}
+
+static int parse_map(struct profile *p, char *save)
+{
+	char *src = strtok_r(NULL, " \t", &save);
+	char *num = strtok_r(NULL, " \t", &save);
+	char *type = strtok_r(NULL, " \t", &save);
+	char *code = strtok_r(NULL, " \t", &save);
+	char *arg = strtok_r(NULL, " \t", &save);
+	struct map_rule *m;
+
+	if (!src || !num || !type || !code || p->maps == PROFILE_MAX_MAPS)
+		return -1;
+	m = &p->map[p->maps];
+	memset(m, 0, sizeof(*m));
+	if (!strcmp(src, "chord")) {
+		char *b, *s2;
+		for (b = strtok_r(num, "+", &s2); b; b = strtok_r(NULL, "+", &s2)) {
+			int n = atoi(b);
+			if (n < 0 || n >= 64)
+				return -1;
+			m->chord |= 1ULL << n;
+		}
+		if (strcmp(type, "key") || !m->chord)
+			return -1;
+		m->kind = REMAP_CHORD;
+	} else if (!strcmp(src, "button") && !strcmp(type, "key")) {
+		m->kind = REMAP_KEY;
+	} else if (!strcmp(src, "button") && !strcmp(type, "abs") && arg) {
+		m->kind = REMAP_BUTTON_ABS;
+		m->param = atoi(arg);
+	} else if (!strcmp(src, "axis") && !strcmp(type, "abs")) {
+		m->kind = REMAP_ABS;
+	} else if (!strcmp(src, "axis") && !strcmp(type, "key") && arg &&
+		(!strcmp(arg, "above") || !strcmp(arg, "below"))) {
+		char *thr = strtok_r(NULL, " \t", &save);
+		if (!thr)
+			return -1;
+		m->kind = REMAP_AXIS_KEY;
+		m->below = !strcmp(arg, "below");
+		m->param = atoi(thr);
+	} else {
+		return -1;
+	}
+	m->src = atoi(num);
+	m->code = parse_code(code, !strcmp(type, "abs") ? ABS_MAX : KEY_MAX);
+	if (m->src < 0 || m->code < 0)
+		return -1;
+	p->maps++;
+	return 0;
+}
+
+/*
+ * The active profiles. Attach requests hold a reference so a reload on the
+ * main thread never frees profiles the attach worker is still reading.
+ */
+struct profile_set {
+	atomic_int refs;
+	struct profile *head;
+};
+
+static const char *config_path;
+static struct profile_set *profiles;
+
+static int16_t *build_axis_lut(const struct axis_config *ac);
+
+static void free_profiles(struct profile *p)
+{
+	while (p) {
+		struct profile *next = p->next;
+		for (int a = 0; a < ABS_CNT; a++)
+			free(p->axis[a].lut);
+		free(p->name);
+		free(p->match_path);
+		free(p->composite);
+		free(p);
+		p = next;
+	}
+}
+
+static int parse_axis(struct axis_config *ac, char *save)
+{
+	char *tok;
+
+	ac->set = 1;
+	while ((tok = strtok_r(NULL, " \t", &save))) {
+		if (!strcmp(tok, "invert")) {
+			ac->invert = 1;
+		} else if (!strcmp(tok, "deadzone")) {
+			if (!(tok = strtok_r(NULL, " \t", &save)))
+				return -1;
+			ac->deadzone = atoi(tok);
+			if (ac->deadzone < 0 || ac->deadzone >= AXIS_MAX)
+				return -1;
+		} else if (!strcmp(tok, "curve")) {
+			if (!(tok = strtok_r(NULL, " \t", &save)))
+				return -1;
+			if (!strcmp(tok, "linear")) {
+				ac->curve = CURVE_LINEAR;
+			} else if (!strcmp(tok, "expo")) {
+				ac->curve = CURVE_EXPO;
+				if (!(tok = strtok_r(NULL, " \t", &save)))
+					return -1;
+				ac->expo = atoi(tok);
+				if (ac->expo < 0 || ac->expo > 100)
+					return -1;
+			} else if (!strcmp(tok, "piecewise") || !strcmp(tok, "custom")) {
+				ac->curve = !strcmp(tok, "custom") ? CURVE_CUSTOM : CURVE_PIECEWISE;
+				ac->points = 0;
+				/* Points run to the end of the line */
+				while ((tok = strtok_r(NULL, " \t", &save))) {
+					if (ac->points == CURVE_MAX_POINTS)
+						return -1;
+					if (ac->curve == CURVE_PIECEWISE) {
+						if (sscanf(tok, "%d:%d", &ac->in[ac->points], &ac->out[ac->points]) != 2)
+							return -1;
+						if (ac->points && ac->in[ac->points] <= ac->in[ac->points - 1])
+							return -1;
+					} else {
+						ac->out[ac->points] = atoi(tok);
 					}
+					ac->points++;
 				}
+				if (ac->points < 2)
+					return -1;
+			} else {
+				return -1;
 			}
+		} else if (!strcmp(tok, "smooth")) {
+			char *beta = strtok_r(NULL, " \t", &save);
+			if (!beta || !(tok = strtok_r(NULL, " \t", &save)))
+				return -1;
+			ac->smooth_alpha = atoi(beta);
+			ac->smooth_beta = atoi(tok);
+			if (ac->smooth_alpha < 1 || ac->smooth_alpha > 100 || ac->smooth_beta < 0 || ac->smooth_beta > 100)
+				return -1;
+		} else if (!strcmp(tok, "predict")) {
+			if (!(tok = strtok_r(NULL, " \t", &save)))
+				return -1;
+			ac->predict_ms = atoi(tok);
+			if (ac->predict_ms < 0 || ac->predict_ms > PREDICT_MAX_MS)
+				return -1;
 		} else {
-			printf("%s - %s\n", property_name, property_value);
+			return -1;
 		}
-		properties = udev_list_entry_get_next(properties);
-	}
-	if (!js_dev) {
-		return;
 	}
-	struct uinput_setup usetup;
+	return 0;
+}
 
-	struct stat st;
-	mode_t add_rw_perms, remove_rw_perms;
+static struct profile *load_profiles(const char *path, int *err)
+{
+	struct profile *head = NULL, **tail = &head, *cur = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	int lineno = 0;
+	FILE *f;
 
-	stat(js_dev->node_name, &st);
+	*err = 0;
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		*err = 1;
+		return NULL;
+	}
+	while (getline(&line, &len, f) != -1) {
+		char *save, *tok;
 
-	js_dev->orig_mode = st.st_mode & 0xFFF;
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		tok = strtok_r(line, " \t", &save);
+		if (!tok)
+			continue;
+		if (!strncmp(tok, "[profile", strlen("[profile"))) {
+			char *name = strtok_r(NULL, " \t]", &save);
+			cur = calloc(1, sizeof(*cur));
+			if (!cur) {
+				printf("%s:%d: out of memory\n", path, lineno);
+				*err = 1;
+				break;
+			}
+			*tail = cur;
+			tail = &cur->next;
+			cur->name = strdup(name ? name : "");
+			if (cur->name)
+				continue;
+			printf("%s:%d: out of memory\n", path, lineno);
+			*err = 1;
+			break;
+		}
+		if (!cur) {
+			printf("%s:%d: directive outside of a [profile] section\n", path, lineno);
+			*err = 1;
+			break;
+		}
+		if (!strcmp(tok, "match")) {
+			char *kind = strtok_r(NULL, " \t", &save);
+			char *val = strtok_r(NULL, " \t", &save);
+			unsigned int vendor, product;
+			if (kind && val && !strcmp(kind, "usb") && sscanf(val, "%x:%x", &vendor, &product) == 2) {
+				cur->match_usb = 1;
+				cur->vendor = vendor;
+				cur->product = product;
+				continue;
+			} else if (kind && val && !strcmp(kind, "path")) {
+				free(cur->match_path);
+				cur->match_path = strdup(val);
+				if (cur->match_path)
+					continue;
+			}
+		} else if (!strcmp(tok, "axis")) {
+			char *num = strtok_r(NULL, " \t", &save);
+			int a = num ? atoi(num) : -1;
+			if (a >= 0 && a < ABS_CNT && !parse_axis(&cur->axis[a], save))
+				continue;
+		} else if (!strcmp(tok, "map")) {
+			if (!parse_map(cur, save))
+				continue;
+		} else if (!strcmp(tok, "rate")) {
+			char *hz = strtok_r(NULL, " \t", &save);
+			cur->rate_hz = hz ? atoi(hz) : -1;
+			if (cur->rate_hz >= 0 && cur->rate_hz <= 1000000)
+				continue;
+		} else if (!strcmp(tok, "composite")) {
+			char *name = strtok_r(NULL, " \t", &save);
+			if (name) {
+				free(cur->composite);
+				cur->composite = strdup(name);
+				if (cur->composite)
+					continue;
+			}
+		}
+		printf("%s:%d: invalid directive\n", path, lineno);
+		*err = 1;
+		break;
+	}
+	free(line);
+	fclose(f);
+	if (*err) {
+		free_profiles(head);
+		return NULL;
+	}
+	/*
+	 * Devices share the tables, so attaching one never builds a table.
+	 * A curve without its table would silently forward linearly.
+	 */
+	for (struct profile *p = head; p && !*err; p = p->next) {
+		for (int a = 0; a < ABS_CNT; a++) {
+			if (!p->axis[a].set || p->axis[a].curve == CURVE_LINEAR)
+				continue;
+			p->axis[a].lut = build_axis_lut(&p->axis[a]);
+			if (!p->axis[a].lut) {
+				printf("%s: no memory for the curve of axis %d in profile %s\n", path, a, p->name);
+				*err = 1;
+				break;
+			}
+		}
+	}
+	if (*err) {
+		free_profiles(head);
+		return NULL;
+	}
+	return head;
+}
+
+static struct profile_set *profile_set_new(struct profile *head)
+{
+	struct profile_set *set = calloc(1, sizeof(*set));
+
+	if (!set)
+		return NULL;
+	atomic_init(&set->refs, 1);
+	set->head = head;
+	return set;
+}
+
+static struct profile_set *profile_set_get(struct profile_set *set)
+{
+	if (set)
+		atomic_fetch_add(&set->refs, 1);
+	return set;
+}
+
+static void profile_set_put(struct profile_set *set)
+{
+	if (set && atomic_fetch_sub(&set->refs, 1) == 1) {
+		free_profiles(set->head);
+		free(set);
+	}
+}
+
+static struct profile *find_profile(const struct profile_set *set, const struct input_id *id, const char *id_path)
+{
+	for (struct profile *p = set ? set->head : NULL; p; p = p->next) {
+		if (p->match_usb && (p->vendor != id->vendor || p->product != id->product))
+			continue;
+		if (p->match_path && (!id_path || strcmp(p->match_path, id_path)))
+			continue;
+		return p;
+	}
+	return NULL;
+}
+
+/*
+ * Axis transforms come in two forms. Linear axes (deadzone, invert and the
+ * clamp to AXIS_MAX) are per-axis parameters applied by axis_kernel() to the
+ * whole axis array of a device at once. Curved axes use lookup tables
+ * indexed by the raw joydev value offset by 32768, one load per axis. The
+ * tables belong to the profile, which the transform keeps a reference on.
+ * Axes without configuration get identity parameters.
+ */
+#define AXIS_LUT_SIZE 65536
+#define AXIS_LUT_INDEX(v) ((uint16_t) ((v) + 32768))
+/* Deadzone rescale factor, 16.16 fixed point */
+#define AXIS_SCALE_ONE 65536
+
+struct transform {
+	int axes;
+	struct profile_set *profiles;	/* owns the lookup tables */
+	uint64_t lut_mask;	/* axes with a lookup table */
+	int32_t deadzone[ABS_CNT];
+	int32_t scale[ABS_CNT];
+	int32_t sign[ABS_CNT];	/* -1 inverts */
+	const int16_t *lut[];
+};
+
+static double curve_eval(const struct axis_config *ac, double x)
+{
+	switch (ac->curve) {
+	case CURVE_EXPO: {
+		double k = ac->expo / 100.0;
+		return (1.0 - k) * x + k * x * x * x;
+	}
+	case CURVE_PIECEWISE: {
+		double v = x * AXIS_MAX;
+		if (v <= ac->in[0])
+			return ac->out[0] / (double) AXIS_MAX;
+		for (int i = 1; i < ac->points; i++) {
+			if (v <= ac->in[i]) {
+				double t = (v - ac->in[i - 1]) / (ac->in[i] - ac->in[i - 1]);
+				return (ac->out[i - 1] + t * (ac->out[i] - ac->out[i - 1])) / AXIS_MAX;
+			}
+		}
+		return ac->out[ac->points - 1] / (double) AXIS_MAX;
+	}
+	case CURVE_CUSTOM: {
+		/* Output samples evenly spaced over the input range */
+		double pos = (x + 1.0) / 2.0 * (ac->points - 1);
+		int i = (int) pos;
+		if (i >= ac->points - 1)
+			return ac->out[ac->points - 1] / (double) AXIS_MAX;
+		double t = pos - i;
+		return (ac->out[i] + t * (ac->out[i + 1] - ac->out[i])) / AXIS_MAX;
+	}
+	case CURVE_LINEAR:
+	default:
+		return x;
+	}
+}
+
+static int16_t *build_axis_lut(const struct axis_config *ac)
+{
+	int16_t *lut = malloc(AXIS_LUT_SIZE * sizeof(int16_t));
+
+	if (!lut)
+		return NULL;
+	for (int v = -32768; v < 32768; v++) {
+		int in = v < -AXIS_MAX ? -AXIS_MAX : v;
+		int mag = abs(in);
+		double x = 0.0, y;
+
+		if (mag > ac->deadzone)
+			x = (double) (mag - ac->deadzone) / (AXIS_MAX - ac->deadzone) * (in < 0 ? -1 : 1);
+		y = curve_eval(ac, x);
+		if (ac->invert)
+			y = -y;
+		if (y > 1.0)
+			y = 1.0;
+		else if (y < -1.0)
+			y = -1.0;
+		y *= AXIS_MAX;
+		lut[AXIS_LUT_INDEX(v)] = (int16_t) (y < 0 ? y - 0.5 : y + 0.5);
+	}
+	return lut;
+}
+
+static struct transform *build_transform(struct profile_set *set, const struct profile *p, int axes)
+{
+	struct transform *t = arena_alloc(ARENA_TRANSFORM);
+
+	if (!t)
+		return NULL;
+	t->axes = axes;
+	if (p)
+		t->profiles = profile_set_get(set);
+	for (int a = 0; a < axes; a++) {
+		const struct axis_config *ac = p ? &p->axis[a] : NULL;
+
+		t->scale[a] = AXIS_SCALE_ONE;
+		t->sign[a] = 1;
+		if (!ac || !ac->set)
+			continue;
+		if (ac->lut) {
+			t->lut[a] = ac->lut;
+			t->lut_mask |= 1ULL << a;
+			continue;
+		}
+		t->deadzone[a] = ac->deadzone;
+		t->scale[a] = ((int64_t) AXIS_MAX * AXIS_SCALE_ONE + (AXIS_MAX - ac->deadzone) / 2) /
+			      (AXIS_MAX - ac->deadzone);
+		t->sign[a] = ac->invert ? -1 : 1;
+	}
+	return t;
+}
+
+static void free_transform(struct transform *t)
+{
+	if (!t)
+		return;
+	profile_set_put(t->profiles);
+	arena_free(t);
+}
+
+/*
+ * The magnitude past the deadzone times the scale stays below 2^32, so the
+ * product is taken unsigned and needs no 64-bit lanes.
+ */
+static inline int axis_linear(const struct transform *t, int axis, int value)
+{
+	uint32_t mag = abs(value);
+
+	mag = mag > (uint32_t) t->deadzone[axis] ? mag - t->deadzone[axis] : 0;
+	mag = (mag * (uint32_t) t->scale[axis]) >> 16;
+	if (mag > AXIS_MAX)
+		mag = AXIS_MAX;
+	return (value < 0 ? -(int) mag : (int) mag) * t->sign[axis];
+}
+
+static inline int axis_transform(const struct transform *t, int axis, int value)
+{
+	const int16_t *lut = t->lut[axis];
+
+	return lut ? lut[AXIS_LUT_INDEX(value)] : axis_linear(t, axis, value);
+}
+
+/*
+ * Runs the linear transform over in[] into next[] and returns the mask of
+ * axes whose result differs from out[]. Arrays are ABS_CNT long so the
+ * vector versions may run past the last axis; those lanes are masked off.
+ * Lookup table axes get a linear result here and are fixed up by the caller.
+ */
+typedef uint64_t (*axis_kernel_fn)(const struct transform *t, const int32_t *in,
+				   const int32_t *out, int32_t *next);
+
+static uint64_t axis_kernel_scalar(const struct transform *t, const int32_t *in,
+				   const int32_t *out, int32_t *next)
+{
+	uint64_t changed = 0;
+
+	for (int a = 0; a < t->axes; a++) {
+		next[a] = axis_linear(t, a, in[a]);
+		changed |= (uint64_t) (next[a] != out[a]) << a;
+	}
+	return changed;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.1")))
+static uint64_t axis_kernel_sse41(const struct transform *t, const int32_t *in,
+				  const int32_t *out, int32_t *next)
+{
+	const __m128i max = _mm_set1_epi32(AXIS_MAX);
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t changed = 0;
+
+	for (int a = 0; a < t->axes; a += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *) &in[a]);
+		__m128i mag = _mm_abs_epi32(x);
+		mag = _mm_max_epi32(_mm_sub_epi32(mag, _mm_loadu_si128((const __m128i *) &t->deadzone[a])), zero);
+		mag = _mm_srli_epi32(_mm_mullo_epi32(mag, _mm_loadu_si128((const __m128i *) &t->scale[a])), 16);
+		mag = _mm_min_epu32(mag, max);
+		x = _mm_sign_epi32(_mm_sign_epi32(mag, x), _mm_loadu_si128((const __m128i *) &t->sign[a]));
+		_mm_storeu_si128((__m128i *) &next[a], x);
+		__m128i same = _mm_cmpeq_epi32(x, _mm_loadu_si128((const __m128i *) &out[a]));
+		changed |= (uint64_t) (~_mm_movemask_ps(_mm_castsi128_ps(same)) & 0xf) << a;
+	}
+	return t->axes < 64 ? changed & ((1ULL << t->axes) - 1) : changed;
+}
+
+__attribute__((target("avx2")))
+static uint64_t axis_kernel_avx2(const struct transform *t, const int32_t *in,
+				 const int32_t *out, int32_t *next)
+{
+	const __m256i max = _mm256_set1_epi32(AXIS_MAX);
+	const __m256i zero = _mm256_setzero_si256();
+	uint64_t changed = 0;
+
+	for (int a = 0; a < t->axes; a += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) &in[a]);
+		__m256i mag = _mm256_abs_epi32(x);
+		mag = _mm256_max_epi32(_mm256_sub_epi32(mag, _mm256_loadu_si256((const __m256i *) &t->deadzone[a])), zero);
+		mag = _mm256_srli_epi32(_mm256_mullo_epi32(mag, _mm256_loadu_si256((const __m256i *) &t->scale[a])), 16);
+		mag = _mm256_min_epu32(mag, max);
+		x = _mm256_sign_epi32(_mm256_sign_epi32(mag, x), _mm256_loadu_si256((const __m256i *) &t->sign[a]));
+		_mm256_storeu_si256((__m256i *) &next[a], x);
+		__m256i same = _mm256_cmpeq_epi32(x, _mm256_loadu_si256((const __m256i *) &out[a]));
+		changed |= (uint64_t) (~_mm256_movemask_ps(_mm256_castsi256_ps(same)) & 0xff) << a;
+	}
+	return t->axes < 64 ? changed & ((1ULL << t->axes) - 1) : changed;
+}
+#endif
+
+static axis_kernel_fn axis_kernel = axis_kernel_scalar;
+static const char *axis_kernel_name = "scalar";
+static unsigned long axis_kernel_runs, axis_event_runs, axis_kernel_outputs;
+
+static void axis_kernel_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		axis_kernel = axis_kernel_avx2;
+		axis_kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		axis_kernel = axis_kernel_sse41;
+		axis_kernel_name = "sse4.1";
+	}
+#endif
+}
+
+#define BENCH_FRAMES 1024	/* random frames, cycled */
+#define BENCH_ROUNDS 200
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * -K: times the per-event path, one axis_transform() and compare per axis
+ * event, against each kernel the CPU supports. Frames either move every
+ * axis, as a flight stick or a composite does under heavy use, or only a
+ * few, as a pad with one stick in use does; the per-event path then
+ * transforms just those while a kernel still runs over the whole array.
+ * Linear axes with a deadzone, every other one inverted.
+ */
+static void axis_kernel_bench(void)
+{
+	static const int sizes[] = { 8, 16, 32, 64 };
+	static const int moves[] = { 0, 8, 4, 1 };	/* 0: every axis */
+	static struct profile p;
+	static int32_t frame[BENCH_FRAMES][ABS_CNT];
+	static uint64_t moved[BENCH_FRAMES];
+	struct {
+		const char *name;
+		axis_kernel_fn fn;
+	} kernels[3] = { { "scalar", axis_kernel_scalar } };
+	int nkernels = 1;
+	volatile uint64_t sink = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1"))
+		kernels[nkernels++] = (typeof(kernels[0])) { "sse4.1", axis_kernel_sse41 };
+	if (__builtin_cpu_supports("avx2"))
+		kernels[nkernels++] = (typeof(kernels[0])) { "avx2", axis_kernel_avx2 };
+#endif
+	for (int a = 0; a < ABS_CNT; a++) {
+		p.axis[a].set = 1;
+		p.axis[a].deadzone = 2000;
+		p.axis[a].invert = a & 1;
+	}
+	printf("Axis transform, ns per frame over %d frames\n", BENCH_FRAMES * BENCH_ROUNDS);
+	printf("axes moved  per-event");
+	for (int k = 0; k < nkernels; k++)
+		printf(" %9s", kernels[k].name);
+	printf("\n");
+	for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int axes = sizes[i];
+		struct transform *t = build_transform(NULL, &p, axes);
+
+		if (!t)
+			return;
+
+		for (int j = 0; j < sizeof(moves) / sizeof(moves[0]); j++) {
+			int32_t out[ABS_CNT] = { 0 }, next[ABS_CNT];
+			uint64_t start;
+
+			if (moves[j] >= axes)
+				continue;
+
+			/* Each frame carries the previous one with its moved axes new */
+			srand(1);
+			for (int f = 0; f < BENCH_FRAMES; f++) {
+				uint64_t all = axes < 64 ? (1ULL << axes) - 1 : ~0ULL;
+
+				memcpy(frame[f], frame[f ? f - 1 : BENCH_FRAMES - 1], sizeof(frame[f]));
+				moved[f] = moves[j] ? 0 : all;
+				while (__builtin_popcountll(moved[f]) < moves[j])
+					moved[f] |= 1ULL << rand() % axes;
+				for (uint64_t m = moved[f]; m; m &= m - 1)
+					frame[f][__builtin_ctzll(m)] = rand() % 65535 - 32767;
+			}
+			start = bench_ns();
+			for (int r = 0; r < BENCH_ROUNDS; r++) {
+				for (int f = 0; f < BENCH_FRAMES; f++) {
+					for (uint64_t m = moved[f]; m; m &= m - 1) {
+						int a = __builtin_ctzll(m);
+						int v = axis_transform(t, a, frame[f][a]);
+						if (v != out[a]) {
+							out[a] = v;
+							sink++;
+						}
+					}
+				}
+			}
+			if (moves[j])
+				printf("%4d %5d", axes, moves[j]);
+			else
+				printf("%4d   all", axes);
+			printf(" %10lu", (unsigned long) ((bench_ns() - start) / (BENCH_FRAMES * BENCH_ROUNDS)));
+			for (int k = 0; k < nkernels; k++) {
+				memset(out, 0, sizeof(out));
+				start = bench_ns();
+				for (int r = 0; r < BENCH_ROUNDS; r++) {
+					for (int f = 0; f < BENCH_FRAMES; f++) {
+						uint64_t changed = kernels[k].fn(t, frame[f], out, next);
+						for (; changed; changed &= changed - 1) {
+							int a = __builtin_ctzll(changed);
+							out[a] = next[a];
+							sink++;
+						}
+					}
+				}
+				printf(" %9lu", (unsigned long) ((bench_ns() - start) / (BENCH_FRAMES * BENCH_ROUNDS)));
+			}
+			printf("\n");
+		}
+		free_transform(t);
+	}
+}
+
+/*
+ * Alpha-beta filter on the raw joydev values, run before the noise filter
+ * and the transform. Position and velocity are 24.8 fixed point, velocity
+ * in units per millisecond of joydev event time. The output leads the
+ * filtered position by predict_ms of the estimated velocity; once a device
+ * has sent nothing for the longest lead, predictor_settle() falls back to
+ * the position so a stick at rest does not stay overshot. The state is kept
+ * as one array per field over the device's axes.
+ */
+/* A gap this long restarts the filter at the new sample */
+#define PREDICT_MAX_GAP_MS 100
+
+struct predictor {
+	int axes;
+	int lead_max_ms;
+	uint64_t pending;	/* axes whose output still holds a lead */
+	uint64_t due;		/* axes with a lead to check against a sample */
+	uint64_t settle_us;
+	int32_t alpha[ABS_CNT], beta[ABS_CNT];	/* 0.8 fixed point */
+	int32_t lead_ms[ABS_CNT];
+	int32_t x[ABS_CNT], v[ABS_CNT];
+	uint32_t t[ABS_CNT];
+	uint8_t primed[ABS_CNT];
+	/* Error of the output against later samples */
+	int32_t due_value[ABS_CNT];
+	uint32_t due_t[ABS_CNT];
+	uint64_t lag_err[ABS_CNT], lead_err[ABS_CNT];
+	unsigned long samples[ABS_CNT], leads[ABS_CNT];
+};
+
+static struct predictor *build_predictor(const struct profile *p, int axes)
+{
+	struct predictor *f = NULL;
+
+	for (int a = 0; p && a < axes && a < ABS_CNT; a++) {
+		const struct axis_config *ac = &p->axis[a];
+		if (!ac->smooth_alpha && !ac->predict_ms)
+			continue;
+		if (!f) {
+			f = arena_alloc(ARENA_PREDICTOR);
+			if (!f)
+				return NULL;
+			f->axes = axes < ABS_CNT ? axes : ABS_CNT;
+			for (int i = 0; i < f->axes; i++)
+				f->alpha[i] = 256;
+		}
+		/* Prediction alone still needs a velocity estimate */
+		f->alpha[a] = ac->smooth_alpha ? ac->smooth_alpha * 256 / 100 : 256;
+		f->beta[a] = ac->smooth_alpha ? ac->smooth_beta * 256 / 100 : 51;
+		f->lead_ms[a] = ac->predict_ms;
+		if (ac->predict_ms > f->lead_max_ms)
+			f->lead_max_ms = ac->predict_ms;
+	}
+	return f;
+}
+
+static int predictor_step(struct predictor *f, int a, int z, uint32_t t, int init)
+{
+	int32_t dt = t - f->t[a];
+	int64_t xp, r, out;
+
+	if (a >= f->axes)
+		return z;
+	f->samples[a]++;
+	if ((f->due & 1ULL << a) && (int32_t) (t - f->due_t[a]) >= 0) {
+		f->lead_err[a] += abs(f->due_value[a] - z);
+		f->leads[a]++;
+		f->due &= ~(1ULL << a);
+	}
+	if (init || !f->primed[a] || dt < 0 || dt > PREDICT_MAX_GAP_MS) {
+		f->x[a] = z * 256;
+		f->v[a] = 0;
+		f->t[a] = t;
+		f->primed[a] = 1;
+		return z;
+	}
+	xp = f->x[a] + (int64_t) f->v[a] * dt;
+	r = (int64_t) z * 256 - xp;
+	f->x[a] = xp + (f->alpha[a] * r >> 8);
+	/* Samples within one millisecond only correct the position */
+	if (dt)
+		f->v[a] += (f->beta[a] * r >> 8) / dt;
+	f->t[a] = t;
+	out = (f->x[a] + (int64_t) f->v[a] * f->lead_ms[a]) >> 8;
+	if (out > AXIS_MAX)
+		out = AXIS_MAX;
+	else if (out < -AXIS_MAX)
+		out = -AXIS_MAX;
+	f->lag_err[a] += abs((int) out - z);
+	if (f->lead_ms[a] && !(f->due & 1ULL << a)) {
+		f->due_value[a] = out;
+		f->due_t[a] = t + f->lead_ms[a];
+		f->due |= 1ULL << a;
+	}
+	if (f->lead_ms[a])
+		f->pending |= 1ULL << a;
+	return out;
+}
+
+/*
+ * Remapping rules are compiled into one dispatch entry per source button and
+ * per source axis, so an event only runs the actions of its own entry. A
+ * source without rules gets the joydev btnmap/axmap passthrough action.
+ */
+#define REMAP_MAX_ACTIONS 4
+#define REMAP_MAX_CHORDS 16
+
+struct remap_action {
+	uint8_t kind;
+	uint8_t state;
+	uint8_t below;
+	uint16_t code;
+	int param;
+};
+
+struct remap_entry {
+	uint8_t n;
+	struct remap_action act[REMAP_MAX_ACTIONS];
+};
+
+struct remap_chord {
+	uint64_t mask;
+	uint64_t held;
+	uint16_t code;
+	uint8_t on;
+};
+
+struct remap {
+	int axes, buttons;
+	int chords;
+	struct remap_chord chord[REMAP_MAX_CHORDS];
+	struct remap_entry *axis;
+	struct remap_entry *button;
+	struct remap_entry entries[];
+};
+
+static void remap_add(struct remap_entry *e, int kind, int code, int param, int below)
+{
+	if (e->n == REMAP_MAX_ACTIONS) {
+		printf("Too many remap actions for one source, ignoring\n");
+		return;
+	}
+	e->act[e->n++] = (struct remap_action) { .kind = kind, .code = code, .param = param, .below = below };
+}
+
+static struct remap *build_remap(const struct profile *p, struct joystick *js_dev)
+{
+	struct remap *r = arena_alloc(ARENA_REMAP);
+
+	if (!r)
+		return NULL;
+	r->axes = js_dev->axes;
+	r->buttons = js_dev->buttons;
+	r->axis = r->entries;
+	r->button = r->entries + js_dev->axes;
+
+	for (int i = 0; p && i < p->maps; i++) {
+		const struct map_rule *m = &p->map[i];
+		if (m->kind == REMAP_CHORD) {
+			if (r->chords == REMAP_MAX_CHORDS)
+				continue;
+			struct remap_chord *c = &r->chord[r->chords];
+			c->mask = m->chord;
+			c->code = m->code;
+			for (int b = 0; b < js_dev->buttons && b < 64; b++) {
+				if (m->chord & (1ULL << b))
+					remap_add(&r->button[b], REMAP_CHORD, 0, r->chords, 0);
+			}
+			r->chords++;
+		} else if (m->kind == REMAP_ABS || m->kind == REMAP_AXIS_KEY) {
+			if (m->src < js_dev->axes)
+				remap_add(&r->axis[m->src], m->kind, m->code, m->param, m->below);
+		} else if (m->src < js_dev->buttons) {
+			remap_add(&r->button[m->src], m->kind, m->code, m->param, 0);
+		}
+	}
+
+	/* Sources without explicit rules keep their joydev or composite mapping */
+	const struct composite *c = js_dev->composite;
+	for (int a = 0; a < js_dev->axes; a++) {
+		int code = c ? c->abs_out[js_dev->member][a] : ABS_X + js_dev->cold->caps.axmap[a];
+		if (!r->axis[a].n && code < ABS_CNT)
+			remap_add(&r->axis[a], REMAP_ABS, code, 0, 0);
+	}
+	for (int b = 0; b < js_dev->buttons; b++) {
+		int code = c ? c->key_out[js_dev->member][b] : js_dev->cold->caps.btnmap[b];
+		int remapped = 0;
+		for (int k = 0; k < r->button[b].n; k++)
+			remapped |= r->button[b].act[k].kind != REMAP_CHORD;
+		if (!remapped && code)
+			remap_add(&r->button[b], REMAP_KEY, code, 0, 0);
+	}
+	return r;
+}
+
+/* Adds the output codes of the rules to a key bitmap and an axis mask */
+static void remap_codes(const struct remap *r, uint64_t *keys, uint64_t *abs)
+{
+	for (int i = 0; i < r->axes + r->buttons; i++) {
+		const struct remap_entry *e = &r->entries[i];
+		for (int k = 0; k < e->n; k++) {
+			int code = e->act[k].code;
+			switch (e->act[k].kind) {
+			case REMAP_KEY:
+			case REMAP_AXIS_KEY:
+				keys[code / 64] |= 1ULL << (code % 64);
+				break;
+			case REMAP_ABS:
+			case REMAP_BUTTON_ABS:
+				*abs |= 1ULL << code;
+				break;
+			}
+		}
+	}
+	for (int c = 0; c < r->chords; c++)
+		keys[r->chord[c].code / 64] |= 1ULL << (r->chord[c].code % 64);
+}
+
+/* Advertises every output code of the rules on the uinput device */
+static void remap_set_bits(const struct remap *r, int uinput_fd)
+{
+	uint64_t keys[KEY_WORDS] = { 0 }, abs = 0;
+
+	remap_codes(r, keys, &abs);
+	for (int code = 0; code < KEY_CNT; code++) {
+		if (keys[code / 64] & (1ULL << (code % 64))) {
+			ioctl(uinput_fd, UI_SET_EVBIT, EV_KEY);
+			ioctl(uinput_fd, UI_SET_KEYBIT, code);
+		}
+	}
+	for (int code = 0; code < ABS_CNT; code++) {
+		if (abs & (1ULL << code)) {
+			ioctl(uinput_fd, UI_SET_EVBIT, EV_ABS);
+			ioctl(uinput_fd, UI_SET_ABSBIT, code);
+		}
+	}
+}
+
+static void stage_event(struct joystick *js_dev, int type, int code, int value)
+{
+	struct input_event ie;
+
+	memset(&ie, 0, sizeof(ie));
+	ie.type = type;
+	ie.code = code;
+	ie.value = value;
+	stage_put(js_dev, &ie);
+}
+
+static void remap_button(struct joystick *js_dev, int button, int value)
+{
+	struct remap *r = js_dev->remap;
+	struct remap_entry *e = &r->button[button];
+
+	for (int k = 0; k < e->n; k++) {
+		struct remap_action *a = &e->act[k];
+		switch (a->kind) {
+		case REMAP_KEY:
+			stage_event(js_dev, EV_KEY, a->code, value);
+			break;
+		case REMAP_BUTTON_ABS:
+			stage_event(js_dev, EV_ABS, a->code, value ? a->param : 0);
+			break;
+		case REMAP_CHORD: {
+			struct remap_chord *c = &r->chord[a->param];
+			uint64_t bit = 1ULL << button;
+			int on;
+
+			c->held = value ? c->held | bit : c->held & ~bit;
+			on = c->held == c->mask;
+			if (on != c->on) {
+				c->on = on;
+				stage_event(js_dev, EV_KEY, c->code, on);
+			}
+			break;
+		}
+		}
+	}
+}
+
+static void remap_axis(struct joystick *js_dev, int axis, int value)
+{
+	struct remap_entry *e = &js_dev->remap->axis[axis];
+
+	for (int k = 0; k < e->n; k++) {
+		struct remap_action *a = &e->act[k];
+		if (a->kind == REMAP_ABS) {
+			stage_event(js_dev, EV_ABS, a->code, value);
+		} else if (a->kind == REMAP_AXIS_KEY) {
+			int on = a->below ? value < a->param : value > a->param;
+			if (on != a->state) {
+				a->state = on;
+				stage_event(js_dev, EV_KEY, a->code, on);
+			}
+		}
+	}
+}
+
+/*
+ * Sets the output keys a table holds down for the current inputs. With
+ * prime, the chord and threshold state of a fresh table is first derived
+ * from those inputs.
+ */
+static void remap_keys_down(const struct joystick *js_dev, struct remap *r, int prime, uint64_t *down)
+{
+	for (int b = 0; b < r->buttons; b++) {
+		const struct remap_entry *e = &r->button[b];
+		if (!(js_dev->button[b / 64] >> (b % 64) & 1))
+			continue;
+		for (int k = 0; k < e->n; k++) {
+			if (e->act[k].kind == REMAP_KEY)
+				down[e->act[k].code / 64] |= 1ULL << (e->act[k].code % 64);
+		}
+	}
+	for (int i = 0; i < r->chords; i++) {
+		struct remap_chord *c = &r->chord[i];
+		if (prime) {
+			c->held = c->mask & js_dev->button[0];
+			c->on = c->held == c->mask;
+		}
+		if (c->on)
+			down[c->code / 64] |= 1ULL << (c->code % 64);
+	}
+	for (int a = 0; a < r->axes; a++) {
+		struct remap_entry *e = &r->axis[a];
+		for (int k = 0; k < e->n; k++) {
+			struct remap_action *act = &e->act[k];
+			if (act->kind != REMAP_AXIS_KEY)
+				continue;
+			if (prime) {
+				int value = js_dev->axis_out[a];
+				act->state = act->below ? value < act->param : value > act->param;
+			}
+			if (act->state)
+				down[act->code / 64] |= 1ULL << (act->code % 64);
+		}
+	}
+}
+
+/*
+ * Chord and threshold state lives in the table, so swapping tables while
+ * inputs are held would leave outputs of the old table stuck down and drop
+ * those of the new one. Only the keys that differ are released or pressed.
+ */
+static void remap_carry(struct joystick *js_dev, struct remap *old, struct remap *r)
+{
+	uint64_t was[KEY_WORDS] = { 0 }, now[KEY_WORDS] = { 0 };
+	int staged = 0;
+
+	remap_keys_down(js_dev, old, 0, was);
+	remap_keys_down(js_dev, r, 1, now);
+	for (int w = 0; w < KEY_WORDS; w++) {
+		for (uint64_t diff = was[w] ^ now[w]; diff; diff &= diff - 1) {
+			int b = __builtin_ctzll(diff);
+			stage_event(js_dev, EV_KEY, w * 64 + b, now[w] >> b & 1);
+			staged = 1;
+		}
+	}
+	if (staged)
+		flush_events(js_dev);
+}
+
+#define BENCH_EVENTS 4096	/* random events, cycled */
+
+/*
+ * -R: times one event through the remap dispatch against staging the
+ * joydev code directly, as forwarding did before the remap table. The
+ * stage is emptied after every event so no frame is written.
+ * "passthrough" is the table of a device without a profile, "rules" one
+ * with a chord on every other button pair and a key on every axis.
+ */
+static void remap_bench(void)
+{
+	static struct joystick js;
+	static struct joystick_cold cold;
+	static struct profile p;
+	static struct { uint8_t axis; uint8_t src; int value; } ev[BENCH_EVENTS];
+	struct remap *tables[2];
+	volatile uint64_t sink = 0;
+
+	js.cold = &cold;
+	js.axes = cold.caps.axes = 8;
+	js.buttons = cold.caps.buttons = 16;
+	for (int a = 0; a < js.axes; a++)
+		cold.caps.axmap[a] = a;
+	for (int b = 0; b < js.buttons; b++)
+		cold.caps.btnmap[b] = BTN_JOYSTICK + b;
+	for (int b = 0; b + 1 < js.buttons; b += 4) {
+		p.map[p.maps++] = (struct map_rule) { .kind = REMAP_CHORD, .chord = 3ULL << b, .code = KEY_F1 + b / 4 };
+	}
+	for (int a = 0; a < js.axes; a++) {
+		p.map[p.maps++] = (struct map_rule) { .kind = REMAP_ABS, .src = a, .code = ABS_X + a };
+		p.map[p.maps++] = (struct map_rule) { .kind = REMAP_AXIS_KEY, .src = a, .code = KEY_1 + a, .param = 16000 };
+	}
+	tables[0] = build_remap(NULL, &js);
+	tables[1] = build_remap(&p, &js);
+	if (!tables[0] || !tables[1])
+		return;
+	srand(1);
+	for (int i = 0; i < BENCH_EVENTS; i++) {
+		ev[i].axis = rand() & 1;
+		ev[i].src = ev[i].axis ? rand() % js.axes : rand() % js.buttons;
+		ev[i].value = ev[i].axis ? rand() % 65535 - 32767 : rand() & 1;
+	}
+	printf("Remap dispatch, ns per event over %d events (%d axes, %d buttons)\n",
+	       BENCH_EVENTS * BENCH_ROUNDS, js.axes, js.buttons);
+	printf("    direct  passthrough      rules\n");
+	for (int k = -1; k < 2; k++) {
+		uint64_t start;
+
+		js.remap = k < 0 ? NULL : tables[k];
+		start = bench_ns();
+		for (int r = 0; r < BENCH_ROUNDS; r++) {
+			for (int i = 0; i < BENCH_EVENTS; i++) {
+				if (!js.remap && ev[i].axis)
+					stage_event(&js, EV_ABS, ABS_X + cold.caps.axmap[ev[i].src], ev[i].value);
+				else if (!js.remap)
+					stage_event(&js, EV_KEY, cold.caps.btnmap[ev[i].src], ev[i].value);
+				else if (ev[i].axis)
+					remap_axis(&js, ev[i].src, ev[i].value);
+				else
+					remap_button(&js, ev[i].src, ev[i].value);
+				sink += js.staged + js.key_staged;
+				js.staged = js.key_staged = 0;
+			}
+		}
+		printf(" %10lu", (unsigned long) ((bench_ns() - start) / (BENCH_EVENTS * BENCH_ROUNDS)));
+	}
+	printf("\n");
+	arena_free(tables[0]);
+	arena_free(tables[1]);
+}
+
+/* Emits one axis outside the batch path, keeping axis_out in step */
+static void axis_emit(struct joystick *js_dev, int a, int value)
+{
+	js_dev->axis_in[a] = value;
+	js_dev->axis_out[a] = axis_transform(js_dev->xform, a, value);
+	remap_axis(js_dev, a, js_dev->axis_out[a]);
+}
+
+/*
+ * Transforms the axes a batch moved and emits those whose output changed.
+ * Several events for one axis within a batch leave only the last value, as
+ * they would within one evdev frame. A vector kernel over the whole array
+ * only pays off once a few axes move together (see -K); below that, and on
+ * a CPU without one, each moved axis is transformed on its own.
+ */
+#define AXIS_KERNEL_MIN 8
+
+static int axes_emit(struct joystick *js_dev, uint64_t touched)
+{
+	const struct transform *t = js_dev->xform;
+	int32_t next[ABS_CNT];
+	uint64_t changed = 0;
+	int n = 0;
+
+	if (axis_kernel == axis_kernel_scalar || __builtin_popcountll(touched) < AXIS_KERNEL_MIN) {
+		for (; touched; touched &= touched - 1) {
+			int a = __builtin_ctzll(touched);
+			next[a] = axis_transform(t, a, js_dev->axis_in[a]);
+			changed |= (uint64_t) (next[a] != js_dev->axis_out[a]) << a;
+		}
+		axis_event_runs++;
+	} else {
+		changed = axis_kernel(t, js_dev->axis_in, js_dev->axis_out, next);
+		for (uint64_t m = t->lut_mask; m; m &= m - 1) {
+			int a = __builtin_ctzll(m);
+			next[a] = t->lut[a][AXIS_LUT_INDEX(js_dev->axis_in[a])];
+			changed = (changed & ~(1ULL << a)) | (uint64_t) (next[a] != js_dev->axis_out[a]) << a;
+		}
+		axis_kernel_runs++;
+	}
+	for (; changed; changed &= changed - 1, n++) {
+		int a = __builtin_ctzll(changed);
+		js_dev->axis_out[a] = next[a];
+		remap_axis(js_dev, a, next[a]);
+	}
+	axis_kernel_outputs += n;
+	return n;
+}
+
+/* Drops the lead of every axis once the device has been quiet long enough */
+static void predictor_settle(struct joystick *js_dev)
+{
+	struct predictor *f = js_dev->predict;
+
+	if (!f || !f->pending || now_us() < f->settle_us)
+		return;
+	while (f->pending) {
+		int a = __builtin_ctzll(f->pending);
+		int x = f->x[a] >> 8;
+		f->pending &= f->pending - 1;
+		x = x > AXIS_MAX ? AXIS_MAX : x < -AXIS_MAX ? -AXIS_MAX : x;
+		axis_emit(js_dev, a, x);
+	}
+	flush_events(js_dev);
+}
+
+/* Forwards the values the noise filter has held back for NOISE_HOLD_MS */
+static void noise_settle(struct joystick *js_dev)
+{
+	if (!js_dev->noise_held || now_us() < js_dev->noise_due_us)
+		return;
+	while (js_dev->noise_held) {
+		int a = __builtin_ctzll(js_dev->noise_held);
+		struct axis_noise *n = &js_dev->noise[a];
+		js_dev->noise_held &= js_dev->noise_held - 1;
+		n->out = n->last_raw;
+		n->events_out++;
+		axis_emit(js_dev, a, n->last_raw);
+	}
+	flush_events(js_dev);
+}
+
+/* With the clock stopped, one tick runs the earliest settle of either filter */
+static void settle_wait(struct joystick *js_dev)
+{
+	struct predictor *f = js_dev->predict;
+	uint64_t due = js_dev->noise_held ? js_dev->noise_due_us : 0, now;
+
+	if (f && f->pending && (!due || f->settle_us < due))
+		due = f->settle_us;
+	if (!due || js_dev->tick_armed)
+		return;
+	now = now_us();
+	tick_once(js_dev, due > now ? due - now : 0);
+}
+
+static inline int button_on(const struct joystick *js_dev, int button)
+{
+	return js_dev->button[button / 64] >> (button % 64) & 1;
+}
+
+/*
+ * Makes next the device's button state, running the remap actions of only
+ * the buttons that changed. Returns the number of changes.
+ */
+static int buttons_emit(struct joystick *js_dev, const uint64_t *next)
+{
+	int changes = 0;
+
+	for (int w = 0; w < (js_dev->buttons + 63) / 64; w++) {
+		uint64_t changed = js_dev->button[w] ^ next[w];
+
+		js_dev->button[w] = next[w];
+		while (changed) {
+			int b = __builtin_ctzll(changed);
+			changed &= changed - 1;
+			remap_button(js_dev, w * 64 + b, next[w] >> b & 1);
+			changes++;
+		}
+	}
+	return changes;
+}
+
+static int ff_phys_upload(struct joystick *js_dev, struct ff_slot *slot)
+{
+	struct ff_effect effect = slot->effect;
+	int ret;
+
+	int resident = slot->phys != -1;
+
+	if (slot->soft) {
+		/* Emulated effects are a rumble at the engine's current level */
+		memset(&effect, 0, sizeof(effect));
+		effect.type = FF_RUMBLE;
+		effect.u.rumble.strong_magnitude = slot->soft_strong;
+		effect.u.rumble.weak_magnitude = slot->soft_weak;
+	}
+	effect.id = slot->phys;
+	slot->dirty = 0;
+	js_dev->cold->ff_stats.ioctls++;
+	ret = ioctl(js_dev->cold->event_fd, EVIOCSFF, &effect);
+	if (ret == -1 && slot->phys != -1) {
+		/* The physical effect went away or changed type, upload a new one */
+		ioctl(js_dev->cold->event_fd, EVIOCRMFF, slot->phys);
+		effect.id = -1;
+		js_dev->cold->ff_stats.ioctls++;
+		ret = ioctl(js_dev->cold->event_fd, EVIOCSFF, &effect);
+	}
+	if (ret == -1)
+		ret = -errno;
+	slot->phys = ret ? -1 : effect.id;
+	js_dev->cold->ff_resident += (slot->phys != -1) - resident;
+	return ret;
+}
+
+/*
+ * Frees the physical slot of the least recently used resident effect. An
+ * effect whose play is queued for the next flush is not a candidate, the
+ * flush would drop its play.
+ */
+static int ff_evict(struct joystick *js_dev, struct ff_slot *keep)
+{
+	struct ff_slot *victim = NULL;
+
+	for (int i = 0; i < js_dev->cold->ff_slots; i++) {
+		struct ff_slot *slot = &js_dev->cold->ff[i];
+		if (slot == keep || slot->phys == -1 || slot->play_pending)
+			continue;
+		if (!victim || slot->last_used < victim->last_used)
+			victim = slot;
+	}
+	if (!victim)
+		return -1;
+	js_dev->cold->ff_stats.ioctls++;
+	js_dev->cold->ff_stats.evictions++;
+	ioctl(js_dev->cold->event_fd, EVIOCRMFF, victim->phys);
+	victim->phys = -1;
+	victim->dirty = 0;
+	victim->soft_playing = 0;
+	js_dev->cold->ff_resident--;
+	return 0;
+}
+
+/* Uploads an effect without a physical slot, evicting another if needed */
+static int ff_page_in(struct joystick *js_dev, struct ff_slot *slot)
+{
+	int ret;
+
+	if (js_dev->cold->ff_resident >= js_dev->cold->caps.ff_effects_max && ff_evict(js_dev, slot))
+		return -ENOSPC;
+	ret = ff_phys_upload(js_dev, slot);
+	/* Effects uploaded outside the table can fill the device early */
+	if (ret == -ENOSPC && !ff_evict(js_dev, slot))
+		ret = ff_phys_upload(js_dev, slot);
+	return ret;
+}
+
+/*
+ * Software effect engine for controllers that only rumble, or that ignore
+ * replay timing. Emulated effects are uploaded to the device as a plain
+ * rumble whose magnitudes the engine updates in place; durations, delays,
+ * envelopes and periodic waveforms are played from a hierarchical timer
+ * wheel on the slot's force feedback thread. The wheel shares the thread's
+ * timer fd with the rate limiter and holds at most one timer per playing
+ * effect.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_TIMERS (MAX_SINKS * FF_MAX_EFFECTS)
+/* Update period of envelopes and periodic effects */
+#define FF_SOFT_PERIOD_MS 10
+
+struct wheel_timer {
+	struct wheel_timer *next, *prev;
+	uint64_t expires;	/* in ms ticks */
+	uint8_t level, idx;
+	int16_t js_slot;
+	int16_t effect;
+	unsigned int gen;	/* ff_gen of the slot when armed */
+	unsigned int seq;	/* soft_seq of the effect when armed */
+};
+
+struct ff_wheel {
+	uint64_t now;		/* last tick processed */
+	int count;
+	uint64_t occupied[WHEEL_LEVELS];
+	struct wheel_timer slot[WHEEL_LEVELS][WHEEL_SIZE];
+	struct wheel_timer pool[WHEEL_TIMERS];
+	struct wheel_timer *free;
+};
+
+/* One wheel per slot, run by the slot's force feedback thread */
+static struct ff_wheel ff_wheels[MAX_JOYSTICKS];
+
+static void wheel_init(struct ff_wheel *w)
+{
+	for (int l = 0; l < WHEEL_LEVELS; l++) {
+		for (int i = 0; i < WHEEL_SIZE; i++)
+			w->slot[l][i].next = w->slot[l][i].prev = &w->slot[l][i];
+	}
+	for (int i = 0; i < WHEEL_TIMERS; i++) {
+		w->pool[i].next = w->free;
+		w->free = &w->pool[i];
+	}
+}
+
+static void wheel_insert(struct ff_wheel *w, struct wheel_timer *t)
+{
+	struct wheel_timer *head;
+	int l;
+
+	/* The lowest level whose window still holds the expiry */
+	for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+		if ((t->expires >> (l * WHEEL_BITS)) - (w->now >> (l * WHEEL_BITS)) < WHEEL_SIZE)
+			break;
+	}
+	if (l == WHEEL_LEVELS - 1 &&
+		(t->expires >> (l * WHEEL_BITS)) - (w->now >> (l * WHEEL_BITS)) >= WHEEL_SIZE)
+		t->expires = ((w->now >> (l * WHEEL_BITS)) + WHEEL_SIZE - 1) << (l * WHEEL_BITS);
+	t->level = l;
+	t->idx = (t->expires >> (l * WHEEL_BITS)) & (WHEEL_SIZE - 1);
+	head = &w->slot[l][t->idx];
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+	w->occupied[l] |= 1ULL << t->idx;
+}
+
+static void wheel_unlink(struct ff_wheel *w, struct wheel_timer *t)
+{
+	struct wheel_timer *head = &w->slot[t->level][t->idx];
+
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	if (head->next == head)
+		w->occupied[t->level] &= ~(1ULL << t->idx);
+}
+
+/* Arms or re-arms the single timer of an emulated effect */
+static void wheel_arm(struct joystick *js_dev, int effect, uint64_t at_us)
+{
+	struct ff_wheel *w = &ff_wheels[js_dev - joysticks];
+	struct ff_slot *slot = &js_dev->cold->ff[effect];
+	struct wheel_timer *t = slot->soft_timer;
+
+	if (t) {
+		wheel_unlink(w, t);
+	} else {
+		if (!w->free)
+			return;
+		t = w->free;
+		w->free = t->next;
+		if (!w->count++)
+			w->now = now_us() / 1000;
+	}
+	t->js_slot = js_dev - joysticks;
+	t->effect = effect;
+	t->gen = js_dev->cold->ff_gen;
+	t->seq = slot->soft_seq;
+	t->expires = (at_us + 999) / 1000;
+	if (t->expires <= w->now)
+		t->expires = w->now + 1;
+	slot->soft_timer = t;
+	wheel_insert(w, t);
+}
+
+/* The tick the wheel next has to run, for a due timer or a cascade */
+static uint64_t wheel_next(const struct ff_wheel *w)
+{
+	uint64_t next = 0;
+
+	for (int l = 0; l < WHEEL_LEVELS; l++) {
+		uint64_t base = w->now >> (l * WHEEL_BITS);
+		int start = (base + 1) & (WHEEL_SIZE - 1);
+		uint64_t rot, tick;
+		if (!w->occupied[l])
+			continue;
+		rot = w->occupied[l] >> start | (start ? w->occupied[l] << (WHEEL_SIZE - start) : 0);
+		tick = (base + 1 + __builtin_ctzll(rot)) << (l * WHEEL_BITS);
+		if (!next || tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+static void ff_soft_step(struct joystick *js_dev, int effect);
+
+static void wheel_fire(struct wheel_timer *t)
+{
+	struct joystick *js_dev = &joysticks[t->js_slot];
+
+	pthread_mutex_lock(&js_dev->cold->ff_lock);
+	/* The slot may have been released or the effect stopped since */
+	if (js_dev->cold->ff_gen == t->gen && t->effect < js_dev->cold->ff_slots &&
+		js_dev->cold->ff[t->effect].soft_timer == t) {
+		js_dev->cold->ff[t->effect].soft_timer = NULL;
+		if (js_dev->cold->ff[t->effect].soft_seq == t->seq)
+			ff_soft_step(js_dev, t->effect);
+	}
+	pthread_mutex_unlock(&js_dev->cold->ff_lock);
+}
+
+/* Runs every timer due up to the current time */
+static void wheel_advance(struct ff_wheel *w)
+{
+	uint64_t target = now_us() / 1000;
+
+	while (w->count && w->now < target) {
+		struct wheel_timer list, *t;
+		uint64_t next = wheel_next(w);
+		if (next > target) {
+			w->now = target;
+			break;
+		}
+		w->now = next;
+		/* Move timers of the higher levels down as their window is reached */
+		for (int l = WHEEL_LEVELS - 1; l > 0; l--) {
+			int idx = (w->now >> (l * WHEEL_BITS)) & (WHEEL_SIZE - 1);
+			struct wheel_timer *head = &w->slot[l][idx];
+			if (w->now & ((1ULL << (l * WHEEL_BITS)) - 1))
+				continue;
+			while (head->next != head) {
+				t = head->next;
+				wheel_unlink(w, t);
+				wheel_insert(w, t);
+			}
+		}
+		int idx = w->now & (WHEEL_SIZE - 1);
+		struct wheel_timer *head = &w->slot[0][idx];
+		if (head->next == head)
+			continue;
+		/* Detach the due list so callbacks can re-arm into the wheel */
+		list.next = head->next;
+		list.prev = head->prev;
+		list.next->prev = list.prev->next = &list;
+		head->next = head->prev = head;
+		w->occupied[0] &= ~(1ULL << idx);
+		while (list.next != &list) {
+			t = list.next;
+			t->prev->next = t->next;
+			t->next->prev = t->prev;
+			t->next = t->prev = t;
+			wheel_fire(t);
+			/* A timer re-armed by its callback is back in the wheel */
+			if (t->next == t) {
+				t->next = w->free;
+				w->free = t;
+				w->count--;
+			}
+		}
+	}
+	if (!w->count)
+		w->now = target;
+}
+
+static int ff_has(const struct js_caps *caps, int bit)
+{
+	return (caps->ff_bits[bit / (8 * sizeof(unsigned long))] >> (bit % (8 * sizeof(unsigned long)))) & 1;
+}
+
+/* Whether the engine plays this effect instead of the device */
+static int ff_soft(const struct joystick *js_dev, const struct ff_effect *effect)
+{
+	if (!ff_has(&js_dev->cold->caps, FF_RUMBLE))
+		return 0;
+	if (cfg.ff_soft_timing)
+		return 1;
+	if (!ff_has(&js_dev->cold->caps, effect->type))
+		return 1;
+	return effect->type == FF_PERIODIC && !ff_has(&js_dev->cold->caps, effect->u.periodic.waveform);
+}
+
+/* Waveform value in -0x7fff..0x7fff at a phase of 0..0xffff */
+static int ff_wave(int waveform, unsigned int phase)
+{
+	int half = phase & 0x7fff;
+
+	switch (waveform) {
+	case FF_SQUARE:
+		return phase < 0x8000 ? 0x7fff : -0x7fff;
+	case FF_TRIANGLE:
+		return phase < 0x8000 ? half * 2 - 0x7fff : 0x7fff - half * 2;
+	case FF_SAW_UP:
+		return (int) phase - 0x8000;
+	case FF_SAW_DOWN:
+		return 0x7fff - (int) phase;
+	default:
+		/* A parabola per half period is close enough to a sine for a motor */
+		half = (int) ((int64_t) half * (0x8000 - half) >> 13);
+		if (half > 0x7fff)
+			half = 0x7fff;
+		return phase < 0x8000 ? half : -half;
+	}
+}
+
+static int ff_envelope(const struct ff_envelope *env, int level, unsigned int t, unsigned int length)
+{
+	int mag = abs(level), env_level, from, span;
+
+	if (env->attack_length && t < env->attack_length) {
+		env_level = env->attack_level;
+		from = t;
+		span = env->attack_length;
+	} else if (env->fade_length && length && t + env->fade_length > length) {
+		env_level = env->fade_level;
+		from = length - t;
+		span = env->fade_length;
+	} else {
+		return mag;
+	}
+	return env_level + (mag - env_level) * from / span;
+}
+
+/* Rumble magnitudes of an emulated effect t ms into its playback */
+static void ff_soft_level(const struct ff_effect *effect, unsigned int t, int *strong, int *weak)
+{
+	unsigned int length = effect->replay.length;
+	int level;
+
+	switch (effect->type) {
+	case FF_RUMBLE:
+		*strong = effect->u.rumble.strong_magnitude;
+		*weak = effect->u.rumble.weak_magnitude;
+		return;
+	case FF_CONSTANT:
+		level = ff_envelope(&effect->u.constant.envelope, effect->u.constant.level, t, length);
+		break;
+	case FF_RAMP: {
+		int start = effect->u.ramp.start_level, end = effect->u.ramp.end_level;
+		level = length ? start + (end - start) * (int) t / (int) length : start;
+		level = ff_envelope(&effect->u.ramp.envelope, level, t, length);
+		break;
+	}
+	case FF_PERIODIC: {
+		const struct ff_periodic_effect *p = &effect->u.periodic;
+		unsigned int period = p->period ? p->period : 1;
+		unsigned int phase = ((t + p->phase * period / 0x10000) % period) * 0x10000 / period;
+		int mag = ff_envelope(&p->envelope, p->magnitude, t, length);
+		level = p->offset + mag * ff_wave(p->waveform, phase) / 0x7fff;
+		break;
+	}
+	default:
+		level = 0;
+	}
+	level = abs(level);
+	if (level > 0x7fff)
+		level = 0x7fff;
+	/* Levels are 15 bit, rumble magnitudes 16 bit */
+	*strong = *weak = level * 2;
+}
+
+static void ff_soft_set(struct joystick *js_dev, struct ff_slot *slot, int strong, int weak)
+{
+	struct input_event play;
+
+	if (slot->soft_playing && strong == slot->soft_strong && weak == slot->soft_weak)
+		return;
+	slot->soft_strong = strong;
+	slot->soft_weak = weak;
+	slot->last_used = ++js_dev->cold->ff_clock;
+	js_dev->cold->ff_stats.soft_updates++;
+	/* A rumble already playing takes new levels at the next rate limited flush */
+	if (slot->soft_playing && slot->phys != -1 && cfg.ff_rate_hz) {
+		slot->dirty = 1;
+		js_dev->cold->ff_pending = 1;
+		return;
+	}
+	if (slot->phys == -1 ? ff_page_in(js_dev, slot) : ff_phys_upload(js_dev, slot))
+		return;
+	if (!slot->soft_playing) {
+		memset(&play, 0, sizeof(play));
+		play.type = EV_FF;
+		play.code = slot->phys;
+		play.value = 1;
+		js_dev->cold->ff_stats.writes++;
+		write(js_dev->cold->event_fd, &play, sizeof(play));
+		slot->soft_playing = 1;
+	}
+}
+
+/* Stops the device's rumble but leaves the effect scheduled */
+static void ff_soft_silence(struct joystick *js_dev, struct ff_slot *slot)
+{
+	struct input_event play;
+
+	if (!slot->soft_playing)
+		return;
+	slot->soft_playing = 0;
+	if (slot->phys == -1 || js_dev->cold->event_fd < 0)
+		return;
+	memset(&play, 0, sizeof(play));
+	play.type = EV_FF;
+	play.code = slot->phys;
+	js_dev->cold->ff_stats.writes++;
+	write(js_dev->cold->event_fd, &play, sizeof(play));
+}
+
+/* Playing, or waiting out a delay; a stopped effect may leave a stale timer */
+static int ff_soft_active(const struct ff_slot *slot)
+{
+	return slot->soft_playing || (slot->soft_timer && slot->soft_timer->seq == slot->soft_seq);
+}
+
+static void ff_soft_stop(struct joystick *js_dev, struct ff_slot *slot)
+{
+	slot->soft_seq++;
+	ff_soft_silence(js_dev, slot);
+}
+
+/* Advances an emulated effect and arms its next timer */
+static void ff_soft_step(struct joystick *js_dev, int effect)
+{
+	struct ff_slot *slot = &js_dev->cold->ff[effect];
+	const struct ff_effect *e = &slot->effect;
+	uint64_t now = now_us(), length_us = e->replay.length * 1000ULL;
+	int strong, weak;
+
+	if (js_dev->cold->event_fd < 0)
+		return;
+	if (now < slot->soft_start_us) {
+		wheel_arm(js_dev, effect, slot->soft_start_us);
+		return;
+	}
+	if (length_us && now - slot->soft_start_us >= length_us) {
+		if (--slot->soft_repeat <= 0) {
+			ff_soft_stop(js_dev, slot);
+			return;
+		}
+		slot->soft_start_us = now + e->replay.delay * 1000ULL;
+		if (e->replay.delay) {
+			ff_soft_silence(js_dev, slot);
+			wheel_arm(js_dev, effect, slot->soft_start_us);
+			return;
+		}
+	}
+	ff_soft_level(e, (now - slot->soft_start_us) / 1000, &strong, &weak);
+	ff_soft_set(js_dev, slot, strong, weak);
+	/* A steady rumble only needs to wake up when it ends */
+	if (e->type == FF_RUMBLE || (e->type == FF_CONSTANT &&
+		!e->u.constant.envelope.attack_length && !e->u.constant.envelope.fade_length)) {
+		if (length_us)
+			wheel_arm(js_dev, effect, slot->soft_start_us + length_us);
+	} else {
+		wheel_arm(js_dev, effect, now + FF_SOFT_PERIOD_MS * 1000);
+	}
+}
+
+static void ff_soft_play(struct joystick *js_dev, int effect, int value)
+{
+	struct ff_slot *slot = &js_dev->cold->ff[effect];
+
+	ff_soft_stop(js_dev, slot);
+	if (value <= 0)
+		return;
+	slot->soft_repeat = value;
+	slot->soft_start_us = now_us() + slot->effect.replay.delay * 1000ULL;
+	ff_soft_step(js_dev, effect);
+}
+
+/* Stops an effect on the device, e.g. when another sink takes over */
+static void ff_stop(struct joystick *js_dev, struct ff_slot *slot)
+{
+	struct input_event play;
+
+	slot->play_end_us = 0;
+	slot->play_pending = 0;
+	if (slot->soft) {
+		ff_soft_stop(js_dev, slot);
+		return;
+	}
+	if (slot->phys == -1 || js_dev->cold->event_fd < 0)
+		return;
+	memset(&play, 0, sizeof(play));
+	play.type = EV_FF;
+	play.code = slot->phys;
+	js_dev->cold->ff_stats.writes++;
+	write(js_dev->cold->event_fd, &play, sizeof(play));
+}
+
+/*
+ * Decides whether a sink may start an effect while effects of other sinks
+ * are playing, and stops the effects it overrides.
+ */
+static int ff_arbitrate(struct joystick *js_dev, int sink)
+{
+	uint64_t now = now_us();
+
+	if (js_dev->sinks < 2 || cfg.ff_arbitration == FF_ARB_MIX)
+		return 1;
+	for (int i = 0; cfg.ff_arbitration == FF_ARB_PRIORITY && i < js_dev->cold->ff_slots; i++) {
+		struct ff_slot *slot = &js_dev->cold->ff[i];
+		if (slot->sink < sink && slot->play_end_us > now) {
+			js_dev->cold->ff_stats.sink_denied[sink]++;
+			return 0;
+		}
+	}
+	for (int i = 0; i < js_dev->cold->ff_slots; i++) {
+		struct ff_slot *slot = &js_dev->cold->ff[i];
+		if (slot->sink != sink && slot->play_end_us > now) {
+			js_dev->cold->ff_stats.sink_preempted[slot->sink]++;
+			ff_stop(js_dev, slot);
+		}
+	}
+	return 1;
+}
+
+/* When a play of the effect with this repeat count will be over */
+static uint64_t ff_play_end(const struct ff_effect *effect, int repeat)
+{
+	if (!effect->replay.length)
+		return UINT64_MAX;
+	return now_us() + (effect->replay.delay + effect->replay.length) * 1000ULL * repeat;
+}
+
+static int ff_upload(struct joystick *js_dev, int sink, struct ff_effect *effect)
+{
+	uint64_t start_us = now_us();
+	struct ff_slot *slot;
+	int ret = 0;
+
+	if (effect->id < 0 || effect->id >= js_dev->cold->ff_per_sink)
+		return -EINVAL;
+	slot = &js_dev->cold->ff[sink * js_dev->cold->ff_per_sink + effect->id];
+	int soft = ff_soft(js_dev, effect);
+	js_dev->cold->ff_stats.uploads++;
+	if (slot->valid && slot->phys != -1)
+		js_dev->cold->ff_stats.updates++;
+	if (slot->soft && !soft)
+		ff_soft_stop(js_dev, slot);
+	slot->effect = *effect;
+	slot->valid = 1;
+	slot->soft = soft;
+	slot->last_used = ++js_dev->cold->ff_clock;
+	/* A detached device accepts effects without a physical device */
+	if (js_dev->cold->event_fd < 0)
+		;
+	else if (slot->soft && ff_soft_active(slot))
+		ff_soft_step(js_dev, slot - js_dev->cold->ff);	/* apply the new parameters now */
+	else if (slot->soft && slot->phys != -1)
+		;	/* uploaded with its levels when it is played */
+	else if (slot->phys != -1 && cfg.ff_rate_hz) {
+		if (slot->dirty)
+			js_dev->cold->ff_stats.superseded_updates++;
+		slot->dirty = 1;
+		js_dev->cold->ff_pending = 1;
+	} else if (slot->phys != -1)
+		ret = ff_phys_upload(js_dev, slot);
+	else if (js_dev->cold->ff_resident < js_dev->cold->caps.ff_effects_max)
+		ret = ff_page_in(js_dev, slot);
+	/* Otherwise the effect stays paged out until it is played */
+	js_dev->cold->ff_stats.upload_us += now_us() - start_us;
+	return ret;
+}
+
+static int ff_erase(struct joystick *js_dev, int sink, int id)
+{
+	struct ff_slot *slot;
+	int ret = 0;
+
+	if (id < 0 || id >= js_dev->cold->ff_per_sink)
+		return -EINVAL;
+	slot = &js_dev->cold->ff[sink * js_dev->cold->ff_per_sink + id];
+	js_dev->cold->ff_stats.erases++;
+	if (slot->soft)
+		ff_soft_stop(js_dev, slot);
+	if (slot->phys != -1 && js_dev->cold->event_fd >= 0) {
+		js_dev->cold->ff_stats.ioctls++;
+		if (ioctl(js_dev->cold->event_fd, EVIOCRMFF, slot->phys) == -1)
+			ret = -errno;
+	}
+	if (slot->phys != -1)
+		js_dev->cold->ff_resident--;
+	slot->phys = -1;
+	slot->valid = 0;
+	slot->dirty = 0;
+	slot->play_pending = 0;
+	slot->play_end_us = 0;
+	return ret;
+}
+
+/* Forwards an EV_FF write, returns 1 if an effect play reached the device */
+static int ff_play(struct joystick *js_dev, int sink, struct input_event *ie)
+{
+	struct input_event out = *ie;
+
+	if (js_dev->cold->event_fd < 0)
+		return 0;
+	if (ie->code < FF_GAIN) {
+		int idx = sink * js_dev->cold->ff_per_sink + ie->code;
+		struct ff_slot *slot;
+		if (ie->code >= js_dev->cold->ff_per_sink || !js_dev->cold->ff[idx].valid)
+			return 0;
+		slot = &js_dev->cold->ff[idx];
+		if (ie->value && !ff_arbitrate(js_dev, sink))
+			return 0;
+		slot->play_end_us = ie->value ? ff_play_end(&slot->effect, ie->value) : 0;
+		slot->last_used = ++js_dev->cold->ff_clock;
+		if (slot->soft) {
+			js_dev->cold->ff_stats.plays++;
+			ff_soft_play(js_dev, idx, ie->value);
+			return 1;
+		}
+		if (slot->phys == -1) {
+			/* Stopping a paged out effect needs nothing from the device */
+			if (!ie->value)
+				return 0;
+			uint64_t start_us = now_us();
+			int ret = ff_page_in(js_dev, slot);
+			js_dev->cold->ff_stats.misses++;
+			js_dev->cold->ff_stats.page_in_us += now_us() - start_us;
+			if (ret)
+				return 0;
+		}
+		js_dev->cold->ff_stats.plays++;
+		if (cfg.ff_rate_hz) {
+			if (slot->play_pending)
+				js_dev->cold->ff_stats.superseded_plays++;
+			else
+				slot->play_queued_us = input_event_us(ie);
+			slot->play_pending = 1;
+			slot->play_value = ie->value;
+			js_dev->cold->ff_pending = 1;
+			return 0;
+		}
+		out.code = slot->phys;
+	}
+	js_dev->cold->ff_stats.writes++;
+	write(js_dev->cold->event_fd, &out, sizeof(out));
+	return ie->code < FF_GAIN;
+}
+
+/* Sends the latest state of coalesced effects to the physical device */
+static void ff_flush(struct joystick *js_dev)
+{
+	struct input_event play;
+
+	js_dev->cold->ff_pending = 0;
+	js_dev->cold->ff_flush_us = now_us();
+	if (js_dev->cold->event_fd < 0)
+		return;
+	memset(&play, 0, sizeof(play));
+	play.type = EV_FF;
+	for (int i = 0; i < js_dev->cold->ff_slots; i++) {
+		struct ff_slot *slot = &js_dev->cold->ff[i];
+		unsigned long calls = js_dev->cold->ff_stats.ioctls + js_dev->cold->ff_stats.writes;
+		if (slot->dirty)
+			ff_phys_upload(js_dev, slot);
+		if (slot->play_pending && slot->phys != -1) {
+			play.code = slot->phys;
+			play.value = slot->play_value;
+			js_dev->cold->ff_stats.writes++;
+			write(js_dev->cold->event_fd, &play, sizeof(play));
+			hist_add(&js_dev->cold->ff_stats.op_play.rt, now_us() - slot->play_queued_us);
+			js_dev->cold->ff_stats.op_play.ioctls += js_dev->cold->ff_stats.ioctls + js_dev->cold->ff_stats.writes - calls;
+		}
+		slot->play_pending = 0;
+	}
+}
+
+/* Forgets physical ids when the slot is bound to another physical device */
+static void ff_unbind(struct joystick *js_dev)
+{
+	js_dev->cold->rumble_effect.id = -1;
+	js_dev->cold->ff_resident = 0;
+	for (int i = 0; i < js_dev->cold->ff_slots; i++) {
+		js_dev->cold->ff[i].phys = -1;
+		js_dev->cold->ff[i].dirty = 0;
+		js_dev->cold->ff[i].play_pending = 0;
+		js_dev->cold->ff[i].soft_playing = 0;
+		js_dev->cold->ff[i].soft_seq++;
+		js_dev->cold->ff[i].play_end_us = 0;
+	}
+}
+
+/* Uploads the consumer's effects to a newly bound physical device */
+static void ff_resync(struct joystick *js_dev)
+{
+	for (int i = 0; i < js_dev->cold->ff_slots; i++) {
+		struct ff_slot *slot = &js_dev->cold->ff[i];
+		if (slot->valid && slot->phys == -1 && js_dev->cold->event_fd >= 0 &&
+			js_dev->cold->ff_resident < js_dev->cold->caps.ff_effects_max)
+			ff_phys_upload(js_dev, slot);
+	}
+}
+
+static void ff_init(struct joystick *js_dev)
+{
+	js_dev->cold->ff_per_sink = js_dev->cold->caps.ff_effects_max;
+	if (js_dev->cold->ff_per_sink && js_dev->cold->ff_per_sink < cfg.ff_effects)
+		js_dev->cold->ff_per_sink = cfg.ff_effects;
+	/* The kernel refuses more, and the arena blocks are sized for it */
+	if (js_dev->cold->ff_per_sink > FF_MAX_EFFECTS)
+		js_dev->cold->ff_per_sink = FF_MAX_EFFECTS;
+	/* All sinks page into the same physical effect slots */
+	js_dev->cold->ff_slots = js_dev->cold->ff_per_sink * cfg.sinks;
+	js_dev->cold->ff_resident = 0;
+	js_dev->cold->ff_clock = 0;
+	js_dev->cold->ff = js_dev->cold->ff_slots ? arena_alloc(ARENA_FF) : NULL;
+	for (int i = 0; i < js_dev->cold->ff_slots; i++) {
+		js_dev->cold->ff[i].phys = -1;
+		js_dev->cold->ff[i].sink = i / js_dev->cold->ff_per_sink;
+	}
+	memset(&js_dev->cold->ff_stats, 0, sizeof(js_dev->cold->ff_stats));
+	js_dev->cold->ff_pending = 0;
+	js_dev->cold->ff_flush_us = 0;
+}
+
+/* Plays a short rumble when button 0 is pressed */
+static void ff_demo_rumble(struct joystick *js_dev)
+{
+	struct input_event play;
+	/* Reuse the physical effect by updating it in place */
+	int rumble_id = js_dev->cold->rumble_effect.id;
+
+	if (js_dev->cold->event_fd < 0)
+		return;
+	memset(&js_dev->cold->rumble_effect, 0, sizeof(js_dev->cold->rumble_effect));
+	js_dev->cold->rumble_effect.type = FF_RUMBLE;
+	js_dev->cold->rumble_effect.id = rumble_id;
+	js_dev->cold->rumble_effect.u.rumble.strong_magnitude = 0x8000;
+	js_dev->cold->rumble_effect.u.rumble.weak_magnitude = 0;
+	js_dev->cold->rumble_effect.replay.length = 500;
+	js_dev->cold->rumble_effect.replay.delay = 0;
+	if (ioctl(js_dev->cold->event_fd, EVIOCSFF, &js_dev->cold->rumble_effect) == -1 && rumble_id != -1) {
+		js_dev->cold->rumble_effect.id = -1;
+		ioctl(js_dev->cold->event_fd, EVIOCSFF, &js_dev->cold->rumble_effect);
+	}
+	memset(&play, 0, sizeof(play));
+	play.type = EV_FF;
+	play.code = js_dev->cold->rumble_effect.id;
+	play.value = 1;
+	write(js_dev->cold->event_fd, (const void*) &play, sizeof(play));
+}
+
+/*
+ * Force feedback runs on a thread per slot: EVIOCSFF on a Bluetooth
+ * controller can block for milliseconds, which must hold up neither input
+ * forwarding nor the effects of other controllers. A slot's thread owns
+ * reading its uinput fds, its rate limiter and its timer wheel. The slot's
+ * ff_lock is held while its requests are served and while the main loop
+ * changes the slot's physical device or tears it down, so the main loop
+ * can only wait on a call to the device it is replacing or removing, which
+ * fails at once when the device is gone.
+ */
+#define FF_WORK_RESYNC	(1 << 0)
+#define FF_WORK_RUMBLE	(1 << 1)
+
+/* epoll data of an FF thread: a sink of its slot, or one of its own fds */
+#define FF_EV_KICK	0xfffffffe
+#define FF_EV_TIMER	0xffffffff
+/* Every sink plus the kick and timer fds, so one wait reports them all */
+#define FF_EVENTS	(MAX_SINKS + 2)
+
+static struct {
+	pthread_t thread;
+	int epollfd, kick_fd, timer_fd;
+} ff_workers[MAX_JOYSTICKS];
+/* Set at shutdown; the worker threads return on their next wakeup */
+static atomic_int workers_stop;
+
+static void ff_kick(struct joystick *js_dev, int work)
+{
+	uint64_t one = 1;
+
+	atomic_fetch_or(&js_dev->cold->ff_work, work);
+	write(ff_workers[js_dev - joysticks].kick_fd, &one, sizeof(one));
+}
+
+/* Drains the FF requests of one sink, called with the slot's ff_lock held */
+static void ff_service(struct joystick *js_dev, int sink)
+{
+	struct input_event ie;
+
+	while (sink < js_dev->sinks && read(js_dev->uinput_fd[sink], &ie, sizeof(ie)) == sizeof(ie)) {
+		uint64_t start_us = now_us();
+		unsigned long calls = js_dev->cold->ff_stats.ioctls + js_dev->cold->ff_stats.writes;
+		struct ff_op *op = NULL;
+		if (ie.type == EV_UINPUT) {
+			if (ie.code == UI_FF_UPLOAD) {
+				op = &js_dev->cold->ff_stats.op_upload;
+				struct uinput_ff_upload upload_data;
+				memset(&upload_data, 0, sizeof(upload_data));
+				upload_data.request_id = ie.value;
+				ioctl(js_dev->uinput_fd[sink], UI_BEGIN_FF_UPLOAD, &upload_data);
+				upload_data.retval = ff_upload(js_dev, sink, &upload_data.effect);
+				ioctl(js_dev->uinput_fd[sink], UI_END_FF_UPLOAD, &upload_data);
+			} else if (ie.code == UI_FF_ERASE) {
+				struct uinput_ff_erase erase_data;
+				op = &js_dev->cold->ff_stats.op_erase;
+				memset(&erase_data, 0, sizeof(erase_data));
+				erase_data.request_id = ie.value;
+				ioctl(js_dev->uinput_fd[sink], UI_BEGIN_FF_ERASE, &erase_data);
+				erase_data.retval = ff_erase(js_dev, sink, erase_data.effect_id);
+				ioctl(js_dev->uinput_fd[sink], UI_END_FF_ERASE, &erase_data);
+			}
+		} else if (ie.type == EV_FF) {
+			if (ie.code == FF_GAIN) {
+				printf("Setting force feedback gain to %d%% ... \n", (int)(((ie.value * 1.0f) / 0xFFFF) * 100));
+			} else if (ie.value) {
+				printf("Playing rumble effect code 0x%x value 0x%x on event fd %d..\n", ie.code, ie.value, js_dev->cold->event_fd);
+			}
+			if (ff_play(js_dev, sink, &ie))
+				op = &js_dev->cold->ff_stats.op_play;
+		}
+		/* uinput stamps requests with CLOCK_MONOTONIC, the clock of now_us() */
+		if (ie.type == EV_UINPUT || ie.type == EV_FF)
+			js_dev->cold->ff_stats.sink_requests[sink]++;
+		if (op) {
+			hist_add(&op->rt, now_us() - input_event_us(&ie));
+			op->ioctls += js_dev->cold->ff_stats.ioctls + js_dev->cold->ff_stats.writes - calls;
+		}
+		uint64_t ff_us = now_us() - start_us;
+		if (ff_us > js_dev->cold->ff_stats.max_us)
+			js_dev->cold->ff_stats.max_us = ff_us;
+	}
+}
+
+/* Flushes a slot at once if its rate limit allows, called with ff_lock held */
+static void ff_schedule(struct joystick *js_dev)
+{
+	if (js_dev->cold->ff_pending &&
+		now_us() - js_dev->cold->ff_flush_us >= 1000000 / cfg.ff_rate_hz)
+		ff_flush(js_dev);
+}
+
+/* Arms the slot's timer for its next rate limited flush or wheel tick */
+static void ff_timer_arm(int js_slot)
+{
+	struct joystick *js_dev = &joysticks[js_slot];
+	struct itimerspec its;
+	uint64_t next = wheel_next(&ff_wheels[js_slot]) * 1000, now = now_us();
+
+	if (cfg.ff_rate_hz && js_dev->cold->ff_pending) {
+		uint64_t due = js_dev->cold->ff_flush_us + 1000000 / cfg.ff_rate_hz;
+		if (!next || due < next)
+			next = due;
+	}
+	memset(&its, 0, sizeof(its));
+	if (next) {
+		uint64_t delay = next > now ? next - now : 1;
+		its.it_value.tv_sec = delay / 1000000;
+		its.it_value.tv_nsec = delay % 1000000 * 1000;
+	}
+	timerfd_settime(ff_workers[js_slot].timer_fd, 0, &its, NULL);
+}
+
+static void *ff_worker(void *data)
+{
+	int js_slot = (intptr_t) data;
+	struct joystick *js_dev = &joysticks[js_slot];
+	struct epoll_event events[FF_EVENTS];
+
+	while (1) {
+		int nfds = epoll_wait(ff_workers[js_slot].epollfd, events, FF_EVENTS, -1);
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait ff");
+			return NULL;
+		}
+		/* Kicks and the timer go first, ahead of a flood of requests on a sink */
+		for (int n = 0, front = 0; n < nfds; n++) {
+			if (events[n].data.u32 == FF_EV_KICK || events[n].data.u32 == FF_EV_TIMER) {
+				struct epoll_event tmp = events[front];
+				events[front++] = events[n];
+				events[n] = tmp;
+			}
+		}
+		for (int n = 0; n < nfds; n++) {
+			uint32_t data = events[n].data.u32;
+			if (data == FF_EV_KICK) {
+				uint64_t count;
+				read(ff_workers[js_slot].kick_fd, &count, sizeof(count));
+				if (atomic_load(&workers_stop))
+					return NULL;
+				int work = atomic_exchange(&js_dev->cold->ff_work, 0);
+				if (!work)
+					continue;
+				pthread_mutex_lock(&js_dev->cold->ff_lock);
+				if (work & FF_WORK_RESYNC)
+					ff_resync(js_dev);
+				if (work & FF_WORK_RUMBLE)
+					ff_demo_rumble(js_dev);
+				pthread_mutex_unlock(&js_dev->cold->ff_lock);
+				continue;
+			}
+			if (data == FF_EV_TIMER) {
+				uint64_t expirations;
+				read(ff_workers[js_slot].timer_fd, &expirations, sizeof(expirations));
+				if (js_dev->cold->ff_pending) {
+					pthread_mutex_lock(&js_dev->cold->ff_lock);
+					ff_schedule(js_dev);
+					pthread_mutex_unlock(&js_dev->cold->ff_lock);
+				}
+				wheel_advance(&ff_wheels[js_slot]);
+				continue;
+			}
+			/* The slot may have been released since; it then has no sinks */
+			pthread_mutex_lock(&js_dev->cold->ff_lock);
+			ff_service(js_dev, data);
+			if (cfg.ff_rate_hz)
+				ff_schedule(js_dev);
+			pthread_mutex_unlock(&js_dev->cold->ff_lock);
+		}
+		ff_timer_arm(js_slot);
+	}
+	return NULL;
+}
+
+/* Sets up and starts the force feedback thread of a slot */
+static int ff_worker_start(int js_slot)
+{
+	struct epoll_event ff_ev;
+
+	wheel_init(&ff_wheels[js_slot]);
+	ff_workers[js_slot].epollfd = epoll_create1(EPOLL_CLOEXEC);
+	ff_workers[js_slot].kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ff_workers[js_slot].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ff_workers[js_slot].epollfd == -1 || ff_workers[js_slot].kick_fd == -1 || ff_workers[js_slot].timer_fd == -1)
+		return -1;
+	ff_ev.events = EPOLLIN;
+	ff_ev.data.u32 = FF_EV_KICK;
+	if (epoll_ctl(ff_workers[js_slot].epollfd, EPOLL_CTL_ADD, ff_workers[js_slot].kick_fd, &ff_ev) == -1)
+		return -1;
+	ff_ev.data.u32 = FF_EV_TIMER;
+	if (epoll_ctl(ff_workers[js_slot].epollfd, EPOLL_CTL_ADD, ff_workers[js_slot].timer_fd, &ff_ev) == -1)
+		return -1;
+	return pthread_create(&ff_workers[js_slot].thread, NULL, ff_worker, (void *) (intptr_t) js_slot) ? -1 : 0;
+}
+
+static void ff_watch(struct joystick *js_dev, int js_slot)
+{
+	struct epoll_event ff_ev;
+
+	for (int i = 0; i < js_dev->sinks; i++) {
+		ff_ev.events = EPOLLIN;
+		ff_ev.data.u32 = i;
+		if (epoll_ctl(ff_workers[js_slot].epollfd, EPOLL_CTL_ADD, js_dev->uinput_fd[i], &ff_ev) == -1) {
+			printf("epoll_ctl: Failed to add uinput joystick %d\n", js_slot);
+		}
+	}
+}
+
+/* Reads the identity used as the cache key: EVIOCGID plus a hash of the name */
+static void probe_id(int event_fd, struct js_caps *caps)
+{
+	char name[256];
+
+	memset(caps, 0, sizeof(*caps));
+	ioctl(event_fd, EVIOCGID, &caps->id);
+	memset(name, 0, sizeof(name));
+	ioctl(event_fd, EVIOCGNAME(sizeof(name) - 1), name);
+	caps->name_hash = hash_str(name);
+}
+
+static void probe_caps(int js_fd, int event_fd, struct js_caps *caps)
+{
+	ioctl(js_fd, JSIOCGAXES, &caps->axes);
+	ioctl(js_fd, JSIOCGBUTTONS, &caps->buttons);
+	if (caps->buttons > 0) {
+		ioctl(js_fd, JSIOCGBTNMAP, caps->btnmap);
+		ioctl(event_fd, EVIOCGBIT(EV_KEY, sizeof(caps->key_bits)), caps->key_bits);
+	}
+	if (caps->axes > 0) {
+		ioctl(js_fd, JSIOCGAXMAP, caps->axmap);
+		if (ioctl(event_fd, EVIOCGBIT(EV_ABS, sizeof(caps->abs_bits)), caps->abs_bits) == -1) {
+			perror("Ioctl abs features query");
+			exit(1);
+		}
+	}
+	/* Force Feedback */
+	if (ioctl(event_fd, EVIOCGBIT(EV_FF, sizeof(caps->ff_bits)), caps->ff_bits) == -1) {
+		perror("Ioctl force feedback features query");
+		exit(1);
+	}
+	for (int i = FF_EFFECT_MIN; i < FF_CNT; i++) {
+		if ((caps->ff_bits[i / (8 * sizeof(unsigned long))] >> (i % (8 * sizeof(unsigned long)))) & 1) {
+			caps->has_ff = 1;
+		}
+	}
+	if (caps->has_ff) {
+		ioctl(event_fd, EVIOCGEFFECTS, &caps->ff_effects_max);
+	}
+}
+
+static void apply_caps(int uinput_fd, const struct js_caps *caps)
+{
+#define test_bit(array, bit) ((array[bit / (8 * sizeof(unsigned char))] & (1 << (bit % (8 * sizeof(unsigned char))))))
+	if (caps->buttons > 0) {
+		ioctl(uinput_fd, UI_SET_EVBIT, EV_KEY);
+	}
+	for (int i = BTN_MISC; i < BTN_GEAR_UP + 1; i++) {
+		if (test_bit(caps->key_bits, i)) {
+			printf("Adding BTN: 0x%x\n", i);
+			ioctl(uinput_fd, UI_SET_KEYBIT, i);
+		}
+	}
+#undef test_bit
+#define test_bit(array, bit) ((array[bit / (8 * sizeof(unsigned long))] >> (bit % (8 * sizeof(unsigned long)))) & 1)
+	if (caps->axes > 0) {
+		ioctl(uinput_fd, UI_SET_EVBIT, EV_ABS);
+	}
+	for (int i = ABS_X; i < ABS_CNT; i++) {
+		if (test_bit(caps->abs_bits, i)) {
+			printf("Adding ABS: 0x%x\n", i);
+			ioctl(uinput_fd, UI_SET_ABSBIT, i);
+		}
+	}
+	for (int i = FF_EFFECT_MIN; i < FF_CNT; i++) {
+		if (test_bit(caps->ff_bits, i)) {
+			printf("Adding Force Feedback Effect: 0x%x\n", i);
+			ioctl(uinput_fd, UI_SET_FFBIT, i);
+		}
+	}
+	if (caps->has_ff) {
+		ioctl(uinput_fd, UI_SET_EVBIT, EV_FF);
+	}
+#undef test_bit
+}
+
+/*
+ * Capability cache. A fixed-size file of js_caps records, mapped shared so
+ * lookups and updates are plain memory accesses. Any process that can write
+ * the file can change a record, so a hit is range-checked and validated
+ * against the live axis and button counts and maps; a record that fails is
+ * reprobed and overwritten. When full, the least recently used record is
+ * replaced.
+ */
+#define CAPS_CACHE_MAGIC 0x6a736370
+#define CAPS_CACHE_VERSION 1
+#define CAPS_CACHE_RECORDS 64
+
+struct caps_cache_record {
+	uint32_t valid;
+	uint32_t pad;
+	uint64_t last_used;
+	struct js_caps caps;
+};
+
+struct caps_cache {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t records;
+	uint64_t clock;
+	struct caps_cache_record record[CAPS_CACHE_RECORDS];
+};
+
+static const char *caps_cache_path = "/var/cache/dup-joysticks.cache";
+static struct caps_cache *caps_cache;
+static unsigned long caps_cache_hits, caps_cache_misses, caps_cache_invalidated;
+
+static void caps_cache_open(void)
+{
+	int fd;
+
+	if (!caps_cache_path || !strcmp(caps_cache_path, "none"))
+		return;
+	fd = open(caps_cache_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror(caps_cache_path);
+		return;
+	}
+	if (ftruncate(fd, sizeof(struct caps_cache)) == -1) {
+		perror("caps cache ftruncate");
+		close(fd);
+		return;
+	}
+	caps_cache = mmap(NULL, sizeof(struct caps_cache), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (caps_cache == MAP_FAILED) {
+		perror("caps cache mmap");
+		caps_cache = NULL;
+		return;
+	}
+	if (caps_cache->magic != CAPS_CACHE_MAGIC || caps_cache->version != CAPS_CACHE_VERSION ||
+		caps_cache->record_size != sizeof(struct caps_cache_record) ||
+		caps_cache->records != CAPS_CACHE_RECORDS) {
+		memset(caps_cache, 0, sizeof(*caps_cache));
+		caps_cache->magic = CAPS_CACHE_MAGIC;
+		caps_cache->version = CAPS_CACHE_VERSION;
+		caps_cache->record_size = sizeof(struct caps_cache_record);
+		caps_cache->records = CAPS_CACHE_RECORDS;
+	}
+}
+
+static void caps_cache_close(void)
+{
+	if (caps_cache) {
+		munmap(caps_cache, sizeof(*caps_cache));
+		caps_cache = NULL;
+	}
+}
+
+static struct caps_cache_record *caps_cache_find(const struct js_caps *key)
+{
+	for (int i = 0; caps_cache && i < CAPS_CACHE_RECORDS; i++) {
+		struct caps_cache_record *r = &caps_cache->record[i];
+		if (r->valid && !memcmp(&r->caps.id, &key->id, sizeof(key->id)) &&
+			r->caps.name_hash == key->name_hash)
+			return r;
+	}
+	return NULL;
+}
+
+/* The maps index output tables, so every entry must be a code joydev uses */
+static int caps_in_range(const struct js_caps *caps)
+{
+	if (caps->axes > ABS_CNT || caps->buttons > KEY_MAX - BTN_MISC + 1)
+		return 0;
+	for (int a = 0; a < caps->axes; a++) {
+		if (caps->axmap[a] >= ABS_CNT - ABS_X)
+			return 0;
+	}
+	for (int b = 0; b < caps->buttons; b++) {
+		if (caps->btnmap[b] < BTN_MISC || caps->btnmap[b] > KEY_MAX)
+			return 0;
+	}
+	return 1;
+}
+
+/* The live counts and maps match the record */
+static int caps_match(int js_fd, const struct js_caps *caps)
+{
+	uint8_t axes = 0, buttons = 0;
+	uint8_t axmap[ABS_MAX + 1];
+	uint16_t btnmap[KEY_MAX - BTN_MISC + 1];
+
+	ioctl(js_fd, JSIOCGAXES, &axes);
+	ioctl(js_fd, JSIOCGBUTTONS, &buttons);
+	if (axes != caps->axes || buttons != caps->buttons)
+		return 0;
+	if (axes && (ioctl(js_fd, JSIOCGAXMAP, axmap) == -1 || memcmp(axmap, caps->axmap, axes)))
+		return 0;
+	if (buttons && (ioctl(js_fd, JSIOCGBTNMAP, btnmap) == -1 ||
+		memcmp(btnmap, caps->btnmap, buttons * sizeof(btnmap[0]))))
+		return 0;
+	return 1;
+}
+
+/*
+ * Fills caps from the cache or by probing the device. Returns 1 on a
+ * validated cache hit.
+ */
+static int load_caps(int js_fd, int event_fd, struct js_caps *caps)
+{
+	struct caps_cache_record *r;
+
+	probe_id(event_fd, caps);
+	r = caps_cache_find(caps);
+	if (r) {
+		int in_range = caps_in_range(&r->caps);
+		if (in_range && caps_match(js_fd, &r->caps)) {
+			*caps = r->caps;
+			r->last_used = ++caps_cache->clock;
+			caps_cache_hits++;
+			return 1;
+		}
+		printf("Capability cache entry for %04x:%04x is %s\n", caps->id.vendor, caps->id.product,
+		       in_range ? "stale" : "corrupt");
+		r->valid = 0;
+		caps_cache_invalidated++;
+	}
+	caps_cache_misses++;
+	probe_caps(js_fd, event_fd, caps);
+	if (!caps_cache)
+		return 0;
+
+	r = &caps_cache->record[0];
+	for (int i = 0; i < CAPS_CACHE_RECORDS; i++) {
+		struct caps_cache_record *c = &caps_cache->record[i];
+		if (!c->valid) {
+			r = c;
+			break;
+		}
+		if (c->last_used < r->last_used)
+			r = c;
+	}
+	r->valid = 0;
+	r->caps = *caps;
+	r->last_used = ++caps_cache->clock;
+	r->valid = 1;
+	return 0;
+}
+
+static void print_stats(void)
+{
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		struct joystick *js_dev = &joysticks[i];
+		if (js_dev->state != JS_ACTIVE)
+			continue;
+		printf("Wayland Joystick %d: %s\n", i, js_dev->cold->node_name);
+		if (js_dev->composite) {
+			printf("   Member %d of composite %s", js_dev->member, js_dev->composite->name);
+			if (js_dev->composite->owner == i)
+				printf(", %lu merged frames", js_dev->composite->frames);
+			printf("\n");
+		}
+		for (int a = 0; a < js_dev->axes; a++) {
+			struct axis_noise *n = &js_dev->noise[a];
+			printf("   Axis %2d: noise floor %5u, events %lu in, %lu out",
+				a, n->floor_q8 >> 8, n->events_in, n->events_out);
+			if (n->events_in)
+				printf(" (%lu%% suppressed)", (n->events_in - n->events_out) * 100 / n->events_in);
+			struct predictor *f = js_dev->predict;
+			if (f && a < f->axes && f->samples[a]) {
+				printf(", filter off by %lu on average", (unsigned long) (f->lag_err[a] / f->samples[a]));
+				if (f->leads[a])
+					printf(", %d ms lead off by %lu", f->lead_ms[a], (unsigned long) (f->lead_err[a] / f->leads[a]));
+			}
+			printf("\n");
+		}
+		/* Never wait on a slot's FF thread, it may be in a slow device call */
+		struct ff_stats f;
+		memset(&f, 0, sizeof(f));
+		if (pthread_mutex_trylock(&js_dev->cold->ff_lock)) {
+			printf("   Force feedback: busy in a device call\n");
+		} else {
+			f = js_dev->cold->ff_stats;
+			pthread_mutex_unlock(&js_dev->cold->ff_lock);
+		}
+		if (f.uploads || f.plays) {
+			printf("   Force feedback: %lu uploads (%lu in place), %lu erases, %lu plays, %lu ioctls",
+				f.uploads, f.updates, f.erases, f.plays, f.ioctls);
+			if (f.uploads)
+				printf(", %lu us per upload", (unsigned long) (f.upload_us / f.uploads));
+			printf(", %lu us longest request\n", (unsigned long) f.max_us);
+			printf("   Force feedback writes: %lu, superseded %lu updates and %lu plays\n",
+				f.writes, f.superseded_updates, f.superseded_plays);
+			printf("   Force feedback slots: %d virtual, %d physical, %lu misses, %lu evictions",
+				js_dev->cold->ff_slots, js_dev->cold->caps.ff_effects_max, f.misses, f.evictions);
+			if (f.misses)
+				printf(", %lu us per re-upload", (unsigned long) (f.page_in_us / f.misses));
+			printf("\n");
+			if (f.soft_updates)
+				printf("   Software effects: %lu rumble updates\n", f.soft_updates);
+			ff_op_print("Upload", &f.op_upload);
+			ff_op_print("Erase", &f.op_erase);
+			ff_op_print("Play", &f.op_play);
+		}
+		if (js_dev->cold->in_reads) {
+			printf("   Input: %lu events in %lu reads, budget of %d used up %lu times\n",
+				js_dev->cold->in_events, js_dev->cold->in_reads, cfg.js_budget, js_dev->cold->in_throttled);
+		}
+		if (js_dev->out_hz) {
+			printf("   Output clock: %d Hz, %lu frames, %lu values coalesced, %lu button frames between ticks\n",
+				js_dev->out_hz, js_dev->sink_frames[0], js_dev->cold->out_coalesced, js_dev->cold->out_key_frames);
+		}
+		for (int k = 0; js_dev->sinks > 1 && k < js_dev->sinks; k++) {
+			printf("   Output %d: %lu frames, %lu force feedback requests, %lu plays denied, %lu effects preempted\n",
+				k + 1, js_dev->sink_frames[k], f.sink_requests[k], f.sink_denied[k], f.sink_preempted[k]);
+		}
+	}
+	latency_print("Input forwarded after wakeup", &input_latency);
+	hist_print("Button frames written after wakeup", &key_latency);
+	hist_print("Axis frames written after wakeup", &abs_latency);
+	printf("Axis kernel (%s): %lu passes, %lu batches per event, %lu outputs changed\n",
+		axis_kernel_name, axis_kernel_runs, axis_event_runs, axis_kernel_outputs);
+	latency_print("Attach waiting for hotplug to settle", &attach_stats.settle);
+	latency_print("Attach without pool", &attach_stats.created);
+	latency_print("Attach from warm pool", &attach_stats.pooled);
+	latency_print("Reconnect to persistent device", &attach_stats.rebound);
+	if (attach_stats.max_stall_us) {
+		printf("Hotplug stalled input for at most %lu us\n", (unsigned long) attach_stats.max_stall_us);
+	}
+	if (caps_cache) {
+		printf("Capability cache: %lu hits, %lu misses, %lu invalidated\n",
+			caps_cache_hits, caps_cache_misses, caps_cache_invalidated);
+	}
+	printf("Arena: %zu KiB\n", arena_bytes / 1024);
+	pthread_mutex_lock(&arena_lock);
+	for (int k = 0; k < ARENA_KINDS; k++) {
+		struct arena_pool *ap = &arena[k];
+		printf("   %s: %d of %d blocks of %zu bytes in use, peak %d, %lu allocations",
+			ap->name, ap->used, ap->count, ap->size, ap->peak, ap->allocs);
+		if (ap->failures)
+			printf(", %lu failed", ap->failures);
+		printf("\n");
+	}
+	pthread_mutex_unlock(&arena_lock);
+	fflush(stdout);
+}
+
+/*
+ * The jsN and eventN nodes of one controller are children of the same input
+ * device, so that device's syspath pairs them even for identical pads on one
+ * hub or devices without ID_PATH. Halves wait here until both have arrived
+ * and no further add/remove event touched the pair for the settle window,
+ * so a burst of hotplug events results in a single UI_DEV_CREATE.
+ */
+#define PENDING_SLOTS 32
+/* A half whose partner never shows up is dropped after this long */
+#define PENDING_TIMEOUT_US 5000000
+
+struct pending_pair {
+	char *key;
+	char *node_name;
+	char *event_node_name;
+	char *id_path;
+	uint64_t first_us;	/* first add event for this device */
+	uint64_t seen_us;	/* last add event for this device */
+	uint64_t ready_us;	/* both halves present and settled, 0 if incomplete */
+	int tombstone;
+};
+
+static struct pending_pair pending[PENDING_SLOTS];
+
+static struct pending_pair *pending_lookup(const char *key, int create)
+{
+	uint32_t h = hash_str(key);
+	struct pending_pair *free_slot = NULL;
+
+	for (int i = 0; i < PENDING_SLOTS; i++) {
+		struct pending_pair *p = &pending[(h + i) & (PENDING_SLOTS - 1)];
+		if (!p->key) {
+			if (!free_slot)
+				free_slot = p;
+			if (!p->tombstone)
+				break;
+			continue;
+		}
+		if (!strcmp(p->key, key))
+			return p;
+	}
+	if (!create || !free_slot)
+		return NULL;
+	free_slot->key = arena_strdup(key);
+	if (!free_slot->key)
+		return NULL;
+	free_slot->tombstone = 0;
+	return free_slot;
+}
+
+static void pending_remove(struct pending_pair *p)
+{
+	arena_free(p->key);
+	arena_free(p->node_name);
+	arena_free(p->event_node_name);
+	arena_free(p->id_path);
+	memset(p, 0, sizeof(*p));
+	p->tombstone = 1;
+}
+
+/* Drops a half that disappeared before its partner arrived */
+static void pending_remove_node(const char *node_name)
+{
+	for (int i = 0; i < PENDING_SLOTS; i++) {
+		struct pending_pair *p = &pending[i];
+		if (!p->key)
+			continue;
+		if (p->node_name && !strcmp(p->node_name, node_name)) {
+			arena_free(p->node_name);
+			p->node_name = NULL;
+		} else if (p->event_node_name && !strcmp(p->event_node_name, node_name)) {
+			arena_free(p->event_node_name);
+			p->event_node_name = NULL;
+		} else {
+			continue;
+		}
+		p->seen_us = now_us();
+		p->ready_us = 0;
+		if (!p->node_name && !p->event_node_name)
+			pending_remove(p);
+		return;
+	}
+}
+
+static void queue_attach(struct joystick *js_dev, int js_slot, uint64_t seen_us);
+static void release_virtual(struct joystick *js_dev);
+static void hotplug_timer_arm(void);
+
+static void add_joystick(struct udev_device *dev)
+{
+	const char *device_node_name = udev_device_get_devnode(dev);
+	if (!device_node_name)
+	{
+		return;
+	}
+	int is_js = !strncmp(device_node_name, "/dev/input/js", strlen("/dev/input/js"));
+	int is_event = !strncmp(device_node_name, "/dev/input/event", strlen("/dev/input/event"));
+	if (!is_js && !is_event) {
+		return;
+	}
+	struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "input", NULL);
+	const char *key = parent ? udev_device_get_syspath(parent) : NULL;
+	if (!key) {
+		printf("No input parent for %s\n", device_node_name);
+		return;
+	}
+	printf("Device Node Path: %s\n", device_node_name);
+	const char *vendor = udev_device_get_property_value(dev, "ID_VENDOR_ID");
+	const char *model_id = udev_device_get_property_value(dev, "ID_MODEL_ID");
+	const char *model = udev_device_get_property_value(dev, "ID_MODEL");
+	const char *id_path = udev_device_get_property_value(dev, "ID_PATH");
+	if (vendor || model_id) {
+		printf("ID_VENDOR_ID - %s\nID_MODEL_ID - %s\n", vendor ? vendor : "", model_id ? model_id : "");
+	}
+	if (model) {
+		printf("ID_MODEL - %s\n", model);
+	}
+
+	struct pending_pair *p = pending_lookup(key, 1);
+	if (!p) {
+		printf("Too many half-attached devices, ignoring %s\n", device_node_name);
+		return;
+	}
+	char **half = is_js ? &p->node_name : &p->event_node_name;
+	arena_free(*half);
+	*half = arena_strdup(device_node_name);
+	if (id_path && !p->id_path) {
+		p->id_path = arena_strdup(id_path);
+	}
+	p->seen_us = now_us();
+	if (!p->first_us) {
+		p->first_us = p->seen_us;
+	}
+	p->ready_us = 0;
+	if (p->node_name && p->event_node_name) {
+		p->ready_us = p->seen_us + cfg.settle_ms * 1000;
+	}
+	hotplug_timer_arm();
+}
+
+static void pending_attach(struct pending_pair *p)
+{
+	int js_slot = -1;
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		if (joysticks[i].state == JS_FREE) {
+			js_slot = i;
+			break;
+		}
+	}
+	for (int i = 0; js_slot < 0 && i < MAX_JOYSTICKS; i++) {
+		/* A pooled device of another type gives way to a real controller */
+		if (joysticks[i].state == JS_POOLED) {
+			release_virtual(&joysticks[i]);
+			js_slot = i;
+		}
+	}
+	if (js_slot < 0) {
+		printf("%d joysticks maximum\n", MAX_JOYSTICKS);
+		pending_remove(p);
+		return;
+	}
+	struct joystick *js_dev = &joysticks[js_slot];
+	js_dev->cold->node_name = p->node_name;
+	js_dev->cold->event_node_name = p->event_node_name;
+	js_dev->cold->id_path = p->id_path;
+	p->node_name = p->event_node_name = p->id_path = NULL;
+	queue_attach(js_dev, js_slot, p->first_us);
+	pending_remove(p);
+}
+
+/*
+ * Attaches settled pairs and expires stale halves. With force set, every
+ * complete pair is attached right away, as done for the initial scan.
+ */
+static void pending_service(int force)
+{
+	uint64_t now = now_us();
+
+	for (int i = 0; i < PENDING_SLOTS; i++) {
+		struct pending_pair *p = &pending[i];
+
+		if (!p->key)
+			continue;
+		if (p->ready_us && (force || p->ready_us <= now)) {
+			pending_attach(p);
+			continue;
+		}
+		if (!p->ready_us && p->seen_us + PENDING_TIMEOUT_US <= now) {
+			printf("Dropping unpaired %s\n", p->node_name ? p->node_name : p->event_node_name);
+			pending_remove(p);
+		}
+	}
+}
+
+static void hotplug_timer_arm(void)
+{
+	struct itimerspec its;
+	uint64_t next = 0, now = now_us();
+
+	if (hotplug_timer_fd == -1)
+		return;
+	for (int i = 0; i < PENDING_SLOTS; i++) {
+		struct pending_pair *p = &pending[i];
+		uint64_t deadline;
+		if (!p->key)
+			continue;
+		deadline = p->ready_us ? p->ready_us : p->seen_us + PENDING_TIMEOUT_US;
+		if (!next || deadline < next)
+			next = deadline;
+	}
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		if (joysticks[i].state == JS_DETACHED && joysticks[i].cold->detach_deadline_us &&
+			(!next || joysticks[i].cold->detach_deadline_us < next))
+			next = joysticks[i].cold->detach_deadline_us;
+	}
+	memset(&its, 0, sizeof(its));
+	if (next) {
+		/* An expired deadline still needs a non-zero value to fire */
+		uint64_t delay = next > now ? next - now : 1;
+		its.it_value.tv_sec = delay / 1000000;
+		its.it_value.tv_nsec = delay % 1000000 * 1000;
+	}
+	timerfd_settime(hotplug_timer_fd, 0, &its, NULL);
+}
+
+/* Sizes the inline input state from the capabilities and clears it */
+static void reset_inputs(struct joystick *js_dev)
+{
+	js_dev->axes = js_dev->cold->caps.axes < ABS_CNT ? js_dev->cold->caps.axes : ABS_CNT;
+	js_dev->buttons = js_dev->cold->caps.buttons;
+	memset(js_dev->axis, 0, sizeof(js_dev->axis));
+	memset(js_dev->axis_in, 0, sizeof(js_dev->axis_in));
+	memset(js_dev->axis_out, 0, sizeof(js_dev->axis_out));
+	memset(js_dev->button, 0, sizeof(js_dev->button));
+	memset(js_dev->noise, 0, sizeof(js_dev->noise));
+	js_dev->noise_held = 0;
+	memset(js_dev->cold->rest, 0, sizeof(js_dev->cold->rest));
+}
+
+/*
+ * The attach worker runs in two steps, both of which can block for
+ * milliseconds: probe_joystick() opens the nodes and learns the
+ * capabilities, then the main loop either rebinds the device to a detached
+ * virtual device or sends it back for create_joystick(). The main loop only
+ * starts polling the slot once publish_joystick() has run.
+ */
+static void probe_joystick(struct joystick *js_dev)
+{
+
+	struct stat st;
+	mode_t add_rw_perms, remove_rw_perms;
+
+	stat(js_dev->cold->node_name, &st);
+
+	js_dev->cold->orig_mode = st.st_mode & 0xFFF;
+
+	add_rw_perms = js_dev->cold->orig_mode | S_IRUSR | S_IRGRP;
+	remove_rw_perms = js_dev->cold->orig_mode & ~(S_IRUSR | S_IRGRP | S_IROTH);
+
+	chmod(js_dev->cold->node_name, add_rw_perms);
+	int js_fd = open(js_dev->cold->node_name, O_RDONLY);
+	if (js_fd == -1) {
+		perror("open js");
+	}
+	chmod(js_dev->cold->node_name, remove_rw_perms);
+
+	stat(js_dev->cold->event_node_name, &st);
+
+	js_dev->cold->event_orig_mode = st.st_mode & 0xFFF;
+
+	add_rw_perms = js_dev->cold->event_orig_mode | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+	remove_rw_perms = js_dev->cold->event_orig_mode & ~(S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+	chmod(js_dev->cold->event_node_name, add_rw_perms);
+	/* Non-blocking so FF writes never stall behind a slow link */
+	js_dev->cold->event_fd = open(js_dev->cold->event_node_name, O_RDWR | O_NONBLOCK);
+	if (js_dev->cold->event_fd == -1) {
+		perror("open event");
+	}
+	chmod(js_dev->cold->event_node_name, remove_rw_perms);
+	printf("Opened %s: fd: %d\n", js_dev->cold->event_node_name, js_dev->cold->event_fd);
+
+	js_dev->fd = js_fd;
+	if (load_caps(js_fd, js_dev->cold->event_fd, &js_dev->cold->caps)) {
+		printf("Using cached capabilities for %04x:%04x\n", js_dev->cold->caps.id.vendor, js_dev->cold->caps.id.product);
+	}
+	reset_inputs(js_dev);
+	js_dev->cold->rumble_effect.id = -1;
+}
+
+/* Records what create_joystick() advertises, see apply_caps() and remap_set_bits() */
+static void advertised_codes(struct joystick *js_dev)
+{
+	const struct js_caps *caps = &js_dev->cold->caps;
+
+	memset(js_dev->cold->adv_keys, 0, sizeof(js_dev->cold->adv_keys));
+	js_dev->cold->adv_abs = 0;
+	for (int i = BTN_MISC; i < BTN_GEAR_UP + 1; i++) {
+		if (caps->key_bits[i / 8] & (1 << (i % 8)))
+			js_dev->cold->adv_keys[i / 64] |= 1ULL << (i % 64);
+	}
+	for (int i = ABS_X; i < ABS_CNT; i++) {
+		if ((caps->abs_bits[i / (8 * sizeof(unsigned long))] >> (i % (8 * sizeof(unsigned long)))) & 1)
+			js_dev->cold->adv_abs |= 1ULL << i;
+	}
+	remap_codes(js_dev->remap, js_dev->cold->adv_keys, &js_dev->cold->adv_abs);
+	for (int m = 1; js_dev->composite && m < js_dev->composite->members; m++) {
+		int member = js_dev->composite->slot[m];
+		if (member >= 0 && joysticks[member].remap)
+			remap_codes(joysticks[member].remap, js_dev->cold->adv_keys, &js_dev->cold->adv_abs);
+	}
+}
+
+static void create_joystick(struct joystick *js_dev, int js_slot)
+{
+	struct uinput_setup usetup;
+
+	struct profile *profile = find_profile(js_dev->cold->attach_profiles, &js_dev->cold->caps.id, js_dev->cold->id_path);
+	if (profile) {
+		printf("Using profile %s\n", profile->name);
+	}
+	js_dev->xform = build_transform(js_dev->cold->attach_profiles, profile, js_dev->axes);
+	js_dev->predict = build_predictor(profile, js_dev->axes);
+	js_dev->remap = build_remap(profile, js_dev);
+	if (!js_dev->xform || !js_dev->remap) {
+		/* sinks stays 0, attach_step_done() releases the slot */
+		return;
+	}
+	js_dev->out_hz = profile ? profile->rate_hz : 0;
+	ff_init(js_dev);
+	advertised_codes(js_dev);
+	for (int s = 0; s < cfg.sinks; s++) {
+		int uinput_fd = open("/dev/uinput", O_RDWR | O_NONBLOCK);
+		apply_caps(uinput_fd, &js_dev->cold->caps);
+		if (ff_has(&js_dev->cold->caps, FF_RUMBLE)) {
+			/* Effects the device lacks are emulated with rumble */
+			static const int soft_bits[] = { FF_CONSTANT, FF_RAMP, FF_PERIODIC,
+				FF_SQUARE, FF_TRIANGLE, FF_SINE, FF_SAW_UP, FF_SAW_DOWN };
+			for (int i = 0; i < sizeof(soft_bits) / sizeof(soft_bits[0]); i++)
+				ioctl(uinput_fd, UI_SET_FFBIT, soft_bits[i]);
+		}
+		remap_set_bits(js_dev->remap, uinput_fd);
+		/* Waiting members are left alone by the main loop until publish */
+		for (int m = 1; js_dev->composite && m < js_dev->composite->members; m++) {
+			int member = js_dev->composite->slot[m];
+			if (member >= 0 && joysticks[member].remap)
+				remap_set_bits(joysticks[member].remap, uinput_fd);
+		}
+		memset(&usetup, 0, sizeof(usetup));
+		usetup.id.bustype = BUS_USB;
+		usetup.id.vendor = OUTPUT_VENDOR;
+		usetup.id.product = OUTPUT_PRODUCT;
+		usetup.id.version = (ushort) 0x123;
+		usetup.ff_effects_max = js_dev->cold->ff_per_sink;
+		if (s)
+			snprintf(usetup.name, sizeof(usetup.name), "Wayland Joystick %d output %d", js_slot, s + 1);
+		else
+			snprintf(usetup.name, sizeof(usetup.name), "Wayland Joystick %d", js_slot);
+		ioctl(uinput_fd, UI_DEV_SETUP, &usetup);
+		ioctl(uinput_fd, UI_DEV_CREATE);
+		js_dev->uinput_fd[s] = uinput_fd;
+		js_dev->sink_frames[s] = 0;
+	}
+	js_dev->sinks = cfg.sinks;
+}
+
+/* Runs on the attach worker for a pooled device: no physical nodes */
+static void create_pooled(struct joystick *js_dev, int js_slot)
+{
+	reset_inputs(js_dev);
+	create_joystick(js_dev, js_slot);
+}
+
+/*
+ * Attach requests and completions are slot numbers passed through
+ * single-producer single-consumer rings, each paired with an eventfd for
+ * wakeups. The release store of the tail publishes everything the producer
+ * wrote to the slot before pushing it.
+ */
+#define RING_SIZE 16
+
+struct spsc_ring {
+	atomic_uint head;
+	atomic_uint tail;
+	int item[RING_SIZE];
+};
+
+static struct spsc_ring attach_requests, attach_done;
+static int attach_request_fd = -1, attach_done_fd = -1;
+
+static int ring_push(struct spsc_ring *r, int item)
+{
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	if (tail - atomic_load_explicit(&r->head, memory_order_acquire) == RING_SIZE)
+		return -1;
+	r->item[tail & (RING_SIZE - 1)] = item;
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+static int ring_pop(struct spsc_ring *r, int *item)
+{
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head == atomic_load_explicit(&r->tail, memory_order_acquire))
+		return -1;
+	*item = r->item[head & (RING_SIZE - 1)];
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return 0;
+}
+
+/*
+ * SIGHUP only queues a reload: parsing the profiles and building their
+ * curve tables takes milliseconds, so the attach worker does it and the
+ * main loop swaps the result in. The request and its completion pass
+ * through the attach rings like a slot, and the ring publishes the result.
+ */
+#define ATTACH_RELOAD -1
+
+static struct {
+	int queued;	/* On the attach worker, main loop only */
+	int again;	/* SIGHUP arrived while queued, main loop only */
+	struct profile *head;
+	int err;
+} reload;
+
+static void *attach_worker(void *arg)
+{
+	uint64_t count;
+	int slot;
+
+	while (read(attach_request_fd, &count, sizeof(count)) == sizeof(count)) {
+		if (atomic_load(&workers_stop))
+			break;
+		while (!ring_pop(&attach_requests, &slot)) {
+			if (slot == ATTACH_RELOAD) {
+				reload.head = load_profiles(config_path, &reload.err);
+			} else if (joysticks[slot].state == JS_PROBING) {
+				probe_joystick(&joysticks[slot]);
+			} else if (joysticks[slot].state == JS_POOL_CREATING) {
+				create_pooled(&joysticks[slot], slot);
+			} else {
+				create_joystick(&joysticks[slot], slot);
+			}
+			ring_push(&attach_done, slot);
+			count = 1;
+			write(attach_done_fd, &count, sizeof(count));
+		}
+	}
+	return NULL;
+}
+
+static void attach_request(int js_slot)
+{
+	uint64_t one = 1;
+
+	/*
+	 * At most one request per slot and one reload are in flight, so the
+	 * ring cannot fill
+	 */
+	ring_push(&attach_requests, js_slot);
+	write(attach_request_fd, &one, sizeof(one));
+}
+
+static void queue_attach(struct joystick *js_dev, int js_slot, uint64_t seen_us)
+{
+	js_dev->state = JS_PROBING;
+	js_dev->cold->remove_pending = 0;
+	js_dev->fd = js_dev->cold->event_fd = -1;
+	js_dev->sinks = 0;
+	js_dev->cold->attach_start_us = seen_us;
+	latency_add(&attach_stats.settle, now_us() - seen_us);
+	js_dev->cold->attach_profiles = profile_set_get(profiles);
+	attach_request(js_slot);
+}
+
+static void remove_joystick(const char *node_name);
+static void release_physical(struct joystick *js_dev);
+
+/* Returns -1 and keeps the old tables if the new ones do not fit the arena */
+static int rebuild_tables(struct joystick *js_dev)
+{
+	struct profile *profile = find_profile(profiles, &js_dev->cold->caps.id, js_dev->cold->id_path);
+	struct transform *xform = build_transform(profiles, profile, js_dev->axes);
+	struct remap *remap = build_remap(profile, js_dev);
+
+	if (!xform || !remap) {
+		printf("Keeping the old tables of wayland joystick %d\n", (int) (js_dev - joysticks));
+		free_transform(xform);
+		arena_free(remap);
+		return -1;
+	}
+	if (js_dev->remap && (js_dev->state == JS_ACTIVE || js_dev->state == JS_MEMBER))
+		remap_carry(js_dev, js_dev->remap, remap);
+	free_transform(js_dev->xform);
+	arena_free(js_dev->remap);
+	js_dev->xform = xform;
+	js_dev->remap = remap;
+	arena_free(js_dev->predict);
+	js_dev->predict = build_predictor(profile, js_dev->axes);
+	if (js_dev->out_hz != (profile ? profile->rate_hz : 0)) {
+		js_dev->out_hz = profile ? profile->rate_hz : 0;
+		if (js_dev->tick_armed)
+			tick_arm(js_dev, 1);
+	}
+	return 0;
+}
+
+/*
+ * Warm pool. Up to pool_size uinput devices are kept created ahead of time,
+ * one per recently seen capability set, so a matching controller is bound
+ * to an existing device instead of waiting for UI_DEV_CREATE. Pooled
+ * devices are visible to consumers as idle controllers. The pool is seeded
+ * from the capability cache at startup and refilled by the attach worker.
+ */
+#define POOL_MAX MAX_JOYSTICKS
+
+static struct js_caps pool_recent[POOL_MAX];
+static int pool_recent_count;
+
+static void pool_refill(void);
+
+static void pool_remember(const struct js_caps *caps)
+{
+	int i;
+
+	if (!cfg.pool_size)
+		return;
+	for (i = 0; i < pool_recent_count; i++) {
+		if (!memcmp(&pool_recent[i], caps, sizeof(*caps)))
+			break;
+	}
+	if (i == pool_recent_count && pool_recent_count < cfg.pool_size)
+		pool_recent_count++;
+	if (i == pool_recent_count)
+		i--;
+	memmove(&pool_recent[1], &pool_recent[0], i * sizeof(pool_recent[0]));
+	pool_recent[0] = *caps;
+	pool_refill();
+}
+
+/* Seeds the pool types with the most recently used cache records */
+static void pool_seed(void)
+{
+	uint64_t last = UINT64_MAX;
+
+	while (caps_cache && pool_recent_count < cfg.pool_size) {
+		struct caps_cache_record *best = NULL;
+		for (int i = 0; i < CAPS_CACHE_RECORDS; i++) {
+			struct caps_cache_record *r = &caps_cache->record[i];
+			if (r->valid && r->last_used < last && (!best || r->last_used > best->last_used))
+				best = r;
+		}
+		if (!best)
+			break;
+		last = best->last_used;
+		pool_recent[pool_recent_count++] = best->caps;
+	}
+}
+
+static void pool_refill(void)
+{
+	int free_slots = 0;
+
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		struct joystick *js_dev = &joysticks[i];
+		int wanted = 0;
+		if (js_dev->state == JS_FREE)
+			free_slots++;
+		if (js_dev->state != JS_POOLED)
+			continue;
+		for (int r = 0; r < pool_recent_count; r++)
+			wanted |= !memcmp(&pool_recent[r], &js_dev->cold->caps, sizeof(js_dev->cold->caps));
+		if (!wanted) {
+			release_virtual(js_dev);
+			free_slots++;
+		}
+	}
+	for (int r = 0; r < pool_recent_count; r++) {
+		int have = 0, slot = -1;
+		for (int i = 0; i < MAX_JOYSTICKS; i++) {
+			struct joystick *js_dev = &joysticks[i];
+			if ((js_dev->state == JS_POOLED || js_dev->state == JS_POOL_CREATING) &&
+				!memcmp(&pool_recent[r], &js_dev->cold->caps, sizeof(js_dev->cold->caps)))
+				have = 1;
+			if (js_dev->state == JS_FREE && slot < 0)
+				slot = i;
+		}
+		/* Always leave a slot for a controller of a new type */
+		if (have || slot < 0 || free_slots <= 1)
+			continue;
+		struct joystick *js_dev = &joysticks[slot];
+		free_slots--;
+		js_dev->state = JS_POOL_CREATING;
+		js_dev->fd = js_dev->cold->event_fd = -1;
+		js_dev->sinks = 0;
+		js_dev->cold->caps = pool_recent[r];
+		js_dev->cold->attach_profiles = profile_set_get(profiles);
+		attach_request(slot);
+	}
+}
+
+static void publish_pooled(int js_slot)
+{
+	struct joystick *js_dev = &joysticks[js_slot];
+
+	js_dev->state = JS_POOLED;
+	profile_set_put(js_dev->cold->attach_profiles);
+	js_dev->cold->attach_profiles = NULL;
+	ff_watch(js_dev, js_slot);
+	printf("Pooled wayland joystick %d for %04x:%04x\n", js_slot, js_dev->cold->caps.id.vendor, js_dev->cold->caps.id.product);
+}
+
+/*
+ * A pooled device was created with the profile matching its type, before
+ * any controller's port was known. A profile matched by path may output
+ * codes it never advertised, which the kernel would drop.
+ */
+static int pool_fits(struct joystick *js_dev, const struct joystick *pooled)
+{
+	struct profile *profile = find_profile(profiles, &js_dev->cold->caps.id, js_dev->cold->id_path);
+	struct remap *r = build_remap(profile, js_dev);
+	uint64_t keys[KEY_WORDS] = { 0 }, abs = 0;
+	int fits = 1;
+
+	if (!r)
+		return 0;
+	remap_codes(r, keys, &abs);
+	arena_free(r);
+	for (int w = 0; w < KEY_WORDS; w++)
+		fits &= !(keys[w] & ~pooled->cold->adv_keys[w]);
+	return fits && !(abs & ~pooled->cold->adv_abs);
+}
+
+/* A detached or pooled virtual device with the same identity and capabilities */
+static int find_detached(const struct joystick *js_dev, int state)
+{
+	int found = -1;
+
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		const struct joystick *d = &joysticks[i];
+		if (d->state != state || d->composite || memcmp(&d->cold->caps, &js_dev->cold->caps, sizeof(d->cold->caps)))
+			continue;
+		/* Prefer the slot last used on the same port */
+		if (d->cold->last_id_path && js_dev->cold->id_path && !strcmp(d->cold->last_id_path, js_dev->cold->id_path))
+			return i;
+		if (found < 0)
+			found = i;
+	}
+	return found;
+}
+
+/* Hands the freshly probed nodes of src over to the detached or pooled slot dst */
+static void rebind_joystick(struct joystick *src, struct joystick *dst, int dst_slot)
+{
+	uint64_t rebind_us = now_us() - src->cold->attach_start_us;
+	int pooled = dst->state == JS_POOLED;
+
+	pthread_mutex_lock(&dst->cold->ff_lock);
+	dst->fd = src->fd;
+	dst->cold->event_fd = src->cold->event_fd;
+	ff_unbind(dst);
+	pthread_mutex_unlock(&dst->cold->ff_lock);
+	dst->cold->orig_mode = src->cold->orig_mode;
+	dst->cold->event_orig_mode = src->cold->event_orig_mode;
+	dst->cold->node_name = src->cold->node_name;
+	dst->cold->event_node_name = src->cold->event_node_name;
+	dst->cold->id_path = src->cold->id_path;
+	src->fd = src->cold->event_fd = -1;
+	src->cold->node_name = src->cold->event_node_name = src->cold->id_path = NULL;
+	profile_set_put(src->cold->attach_profiles);
+	src->cold->attach_profiles = NULL;
+	release_virtual(src);
+	ff_kick(dst, FF_WORK_RESYNC);
+
+	if (pooled) {
+		num_josyticks++;
+	}
+	dst->state = JS_ACTIVE;
+	rebuild_tables(dst);
+	ev.events = EPOLLIN;
+	ev.data.fd = dst->fd;
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, dst->fd, &ev) == -1) {
+		printf("epoll_ctl: Failed to add joystick: %s\n", dst->cold->node_name);
+	}
+	latency_add(pooled ? &attach_stats.pooled : &attach_stats.rebound, rebind_us);
+	printf("%s %s to wayland joystick %d (%lu us)\n", pooled ? "Bound" : "Rebound",
+		dst->cold->event_node_name, dst_slot, (unsigned long) rebind_us);
+	pool_remember(&dst->cold->caps);
+}
+
+static int composite_live(const struct composite *c)
+{
+	int live = 0;
+
+	for (int m = 0; m < c->members; m++)
+		live += c->slot[m] >= 0;
+	return live;
+}
+
+static struct composite *composite_get(const char *name, int members)
+{
+	struct composite *c;
+	int i, free_idx = -1;
+
+	for (i = 0; i < MAX_JOYSTICKS; i++) {
+		if (composites[i] && !strcmp(composites[i]->name, name))
+			return composites[i];
+		if (!composites[i] && free_idx < 0)
+			free_idx = i;
+	}
+	if (free_idx < 0)
+		return NULL;
+	c = arena_alloc(ARENA_COMPOSITE);
+	if (!c)
+		return NULL;
+	c->name = arena_strdup(name);
+	if (!c->name) {
+		arena_free(c);
+		return NULL;
+	}
+	c->members = members;
+	c->owner = -1;
+	for (int m = 0; m < MAX_MEMBERS; m++)
+		c->slot[m] = -1;
+	composites[free_idx] = c;
+	return c;
+}
+
+static void composite_free(struct composite *c)
+{
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		if (composites[i] == c)
+			composites[i] = NULL;
+	}
+	arena_free(c->name);
+	arena_free(c);
+}
+
+/*
+ * The code itself if valid and still free, else the first free one of the
+ * spare ranges
+ */
+static int composite_free_key(const char *used, int code)
+{
+	static const struct {
+		int first, last;
+	} spare[] = {
+		{ BTN_TRIGGER_HAPPY1, BTN_TRIGGER_HAPPY40 },
+		{ BTN_JOYSTICK, BTN_THUMBR },
+		{ BTN_0, BTN_9 },
+	};
+
+	if (code >= BTN_MISC && code < KEY_CNT && !used[code])
+		return code;
+	for (int r = 0; r < sizeof(spare) / sizeof(spare[0]); r++) {
+		for (int k = spare[r].first; k <= spare[r].last; k++) {
+			if (!used[k])
+				return k;
+		}
+	}
+	return 0;
+}
+
+static int composite_free_abs(const char *used, int code)
+{
+	if (code < ABS_CNT && !used[code])
+		return code;
+	for (int k = ABS_X; k <= ABS_MISC; k++) {
+		if (!used[k])
+			return k;
+	}
+	return ABS_CNT;
+}
+
+/* Gives every button and axis of the members its own output code */
+static void composite_layout(struct composite *c)
+{
+	char key_used[KEY_CNT] = { 0 }, abs_used[ABS_CNT] = { 0 };
+
+	for (int m = 0; m < c->members; m++) {
+		const struct js_caps *caps = &joysticks[c->slot[m]].cold->caps;
+
+		c->caps[m] = *caps;
+		for (int b = 0; b < caps->buttons; b++) {
+			int code = composite_free_key(key_used, caps->btnmap[b]);
+			if (!code)
+				printf("Composite %s: no button code left for member %d button %d\n", c->name, m, b);
+			else if (code != caps->btnmap[b])
+				printf("Composite %s: member %d button %d as 0x%x\n", c->name, m, b, code);
+			key_used[code] = 1;
+			c->key_out[m][b] = code;
+		}
+		for (int a = 0; a < caps->axes; a++) {
+			int code = composite_free_abs(abs_used, ABS_X + caps->axmap[a]);
+			if (code == ABS_CNT) {
+				printf("Composite %s: no axis code left for member %d axis %d\n", c->name, m, a);
+			} else {
+				if (code != ABS_X + caps->axmap[a])
+					printf("Composite %s: member %d axis %d as 0x%x\n", c->name, m, a, code);
+				abs_used[code] = 1;
+			}
+			c->abs_out[m][a] = code;
+		}
+	}
+}
+
+/*
+ * Starts forwarding a member into the composite's virtual device. Returns
+ * -1 if the member has no tables and was released instead.
+ */
+static int composite_activate(struct joystick *js_dev, int js_slot)
+{
+	struct joystick *owner = &joysticks[js_dev->composite->owner];
+
+	if (!js_dev->remap && rebuild_tables(js_dev)) {
+		printf("Dropping %s from composite %s\n", js_dev->cold->event_node_name, js_dev->composite->name);
+		release_physical(js_dev);
+		release_virtual(js_dev);
+		return -1;
+	}
+	if (owner->state == JS_DETACHED) {
+		/* A detached owner is held for as long as members feed it */
+		owner->cold->detach_deadline_us = 0;
+	}
+	js_dev->state = JS_ACTIVE;
+	num_josyticks++;
+	ev.events = EPOLLIN;
+	ev.data.fd = js_dev->fd;
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, js_dev->fd, &ev) == -1) {
+		printf("epoll_ctl: Failed to add joystick: %s\n", js_dev->cold->node_name);
+	}
+	printf("Joined %s to composite %s as member %d of wayland joystick %d\n",
+		js_dev->cold->event_node_name, js_dev->composite->name, js_dev->member, js_dev->composite->owner);
+	return 0;
+}
+
+/* All members are present: the first one creates the virtual device */
+static void composite_form(struct composite *c)
+{
+	composite_layout(c);
+	/* create_joystick() advertises the members' output codes */
+	for (int m = 1; m < c->members; m++) {
+		rebuild_tables(&joysticks[c->slot[m]]);
+	}
+	c->owner = c->slot[0];
+	joysticks[c->owner].state = JS_CREATING;
+	printf("Creating composite %s from %d devices\n", c->name, c->members);
+	attach_request(c->owner);
+}
+
+/*
+ * Runs once a device is probed. Returns 1 if its profile names a composite
+ * and the device now waits for the other members, feeds the existing
+ * virtual device, or was rebound to it as the returning owner.
+ */
+static int composite_join(struct joystick *js_dev, int js_slot)
+{
+	struct profile *p = find_profile(js_dev->cold->attach_profiles, &js_dev->cold->caps.id, js_dev->cold->id_path);
+	struct composite *c;
+	int pos = 0, members = 0;
+
+	if (!p || !p->composite) {
+		return 0;
+	}
+	for (struct profile *q = js_dev->cold->attach_profiles->head; q; q = q->next) {
+		if (q->composite && !strcmp(q->composite, p->composite)) {
+			if (q == p)
+				pos = members;
+			members++;
+		}
+	}
+	c = members <= MAX_MEMBERS ? composite_get(p->composite, members) : NULL;
+	if (!c || pos >= c->members || c->slot[pos] >= 0 ||
+		(c->owner >= 0 && memcmp(&c->caps[pos], &js_dev->cold->caps, sizeof(js_dev->cold->caps)))) {
+		printf("%s does not fit composite %s, attaching it on its own\n", js_dev->cold->event_node_name, p->composite);
+		return 0;
+	}
+	if (c->owner >= 0 && !pos) {
+		c->slot[0] = c->owner;
+		rebind_joystick(js_dev, &joysticks[c->owner], c->owner);
+		return 1;
+	}
+	js_dev->composite = c;
+	js_dev->member = pos;
+	c->slot[pos] = js_slot;
+	if (pos) {
+		/* Only the owner builds tables on the attach worker */
+		profile_set_put(js_dev->cold->attach_profiles);
+		js_dev->cold->attach_profiles = NULL;
+	}
+	if (c->owner >= 0) {
+		composite_activate(js_dev, js_slot);
+		return 1;
+	}
+	js_dev->state = JS_MEMBER;
+	printf("%s waits for composite %s, %d of %d members present\n",
+		js_dev->cold->event_node_name, c->name, composite_live(c), c->members);
+	if (composite_live(c) == c->members) {
+		composite_form(c);
+	}
+	return 1;
+}
+
+/* Drops a released slot from its composite */
+static void composite_leave(struct joystick *js_dev)
+{
+	struct composite *c = js_dev->composite;
+	int js_slot = js_dev - joysticks;
+	struct joystick *owner;
+
+	if (!c) {
+		return;
+	}
+	js_dev->composite = NULL;
+	if (c->slot[js_dev->member] == js_slot) {
+		c->slot[js_dev->member] = -1;
+	}
+	if (c->owner == js_slot) {
+		/* Only happens at exit with members still attached */
+		for (int m = 0; m < c->members; m++) {
+			if (c->slot[m] >= 0)
+				joysticks[c->slot[m]].composite = NULL;
+		}
+		composite_free(c);
+		return;
+	}
+	if (c->owner < 0) {
+		if (!composite_live(c))
+			composite_free(c);
+		return;
+	}
+	owner = &joysticks[c->owner];
+	if (owner->state == JS_DETACHED && !owner->cold->detach_deadline_us && !composite_live(c)) {
+		/* The last member left a detached owner */
+		if (cfg.persist_ms) {
+			owner->cold->detach_deadline_us = now_us() + (uint64_t) cfg.persist_ms * 1000;
+			hotplug_timer_arm();
+		} else {
+			printf("Removing wayland joystick %d, composite %s has no members left\n", c->owner, c->name);
+			release_virtual(owner);
+		}
+	}
+}
 
-	add_rw_perms = js_dev->orig_mode | S_IRUSR | S_IRGRP;
-	remove_rw_perms = js_dev->orig_mode & ~(S_IRUSR | S_IRGRP | S_IROTH);
+/* Runs on the main loop once the worker has finished a slot */
+static void publish_joystick(int js_slot)
+{
+	struct joystick *js_dev = &joysticks[js_slot];
 
-	chmod(js_dev->node_name, add_rw_perms);
-	int js_fd = open(js_dev->node_name, O_RDONLY);
-	if (js_fd == -1) {
-		perror("open js");
+	js_dev->state = JS_ACTIVE;
+	num_josyticks++;
+	if (js_dev->cold->attach_profiles != profiles) {
+		/* The configuration was reloaded while the device was attaching */
+		rebuild_tables(js_dev);
 	}
-	chmod(js_dev->node_name, remove_rw_perms);
+	profile_set_put(js_dev->cold->attach_profiles);
+	js_dev->cold->attach_profiles = NULL;
 
 	ev.events = EPOLLIN;
-	ev.data.fd = js_fd;
+	ev.data.fd = js_dev->fd;
 
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, js_fd, &ev) == -1) {
-		printf("epoll_ctl: Failed to add joystick: %s\n", js_dev->node_name);
-		return;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, js_dev->fd, &ev) == -1) {
+		printf("epoll_ctl: Failed to add joystick: %s\n", js_dev->cold->node_name);
 	}
+	ff_watch(js_dev, js_slot);
 
-	stat(js_dev->event_node_name, &st);
-
-	js_dev->event_orig_mode = st.st_mode & 0xFFF;
+	uint64_t attach_us = now_us() - js_dev->cold->attach_start_us;
+	latency_add(&attach_stats.created, attach_us);
+	printf("Successfully added wayland joystick %d: %s (%lu us)\n", js_slot, js_dev->cold->event_node_name, (unsigned long) attach_us);
+	for (int m = 1; js_dev->composite && m < js_dev->composite->members; m++) {
+		int member = js_dev->composite->slot[m];
+		if (member < 0) {
+			continue;
+		}
+		if (composite_activate(&joysticks[member], member)) {
+			continue;
+		}
+		if (joysticks[member].cold->remove_pending) {
+			remove_joystick(joysticks[member].cold->node_name);
+		}
+	}
+	if (js_dev->cold->remove_pending) {
+		remove_joystick(js_dev->cold->node_name);
+	}
+}
 
-	add_rw_perms = js_dev->event_orig_mode | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
-	remove_rw_perms = js_dev->event_orig_mode & ~(S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+/* The worker could not create the virtual device, see create_joystick() */
+static void attach_failed(int js_slot)
+{
+	struct joystick *js_dev = &joysticks[js_slot];
+	struct composite *c = js_dev->composite;
 
-	chmod(js_dev->event_node_name, add_rw_perms);
-	js_dev->event_fd = open(js_dev->event_node_name, O_RDWR);
-	if (js_dev->event_fd == -1) {
-		perror("open event");
+	printf("Failed to create wayland joystick %d\n", js_slot);
+	/* Waiting members have no virtual device to feed */
+	for (int m = 1; c && m < c->members; m++) {
+		int member = c->slot[m];
+		if (member < 0) {
+			continue;
+		}
+		release_physical(&joysticks[member]);
+		release_virtual(&joysticks[member]);
 	}
-	chmod(js_dev->event_node_name, remove_rw_perms);
-	printf("Opened %s: fd: %d\n", js_dev->event_node_name, js_dev->event_fd);
+	profile_set_put(js_dev->cold->attach_profiles);
+	js_dev->cold->attach_profiles = NULL;
+	release_physical(js_dev);
+	release_virtual(js_dev);
+}
 
-	js_dev->fd = js_fd;
-	ioctl(js_fd, JSIOCGAXES, &js_dev->axes);
-	ioctl(js_fd, JSIOCGBUTTONS, &js_dev->buttons);
-	js_dev->axis = calloc(js_dev->axes, sizeof(int));
-	js_dev->button = calloc(js_dev->buttons, sizeof(char));
-	js_dev->uinput_fd = open("/dev/uinput", O_RDWR | O_NONBLOCK);
-	ev.events = EPOLLIN;
-	ev.data.fd = js_dev->uinput_fd;
+/* Runs on the main loop each time the worker has finished a step */
+static void attach_step_done(int js_slot)
+{
+	struct joystick *js_dev = &joysticks[js_slot];
 
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, js_dev->uinput_fd, &ev) == -1) {
-		printf("epoll_ctl: Failed to add joystick: %s\n", device_node_name);
+	if ((js_dev->state == JS_CREATING || js_dev->state == JS_POOL_CREATING) && !js_dev->sinks) {
+		attach_failed(js_slot);
 		return;
 	}
-#define test_bit(array, bit) ((array[bit / (8 * sizeof(unsigned char))] & (1 << (bit % (8 * sizeof(unsigned char))))))
-	unsigned char key_bits[KEY_MAX / 8 + 1];
-	memset(key_bits, 0, sizeof(key_bits));
-	if (js_dev->buttons > 0) {
-		ioctl(js_dev->uinput_fd, UI_SET_EVBIT, EV_KEY);
-		memset(js_dev->btnmap, 0, sizeof(js_dev->btnmap));
-		ioctl(js_dev->fd, JSIOCGBTNMAP, js_dev->btnmap);
-		ioctl(js_dev->event_fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), &key_bits);
+	if (js_dev->state == JS_CREATING) {
+		publish_joystick(js_slot);
+		pool_remember(&js_dev->cold->caps);
+		return;
 	}
-	for (int i = BTN_MISC; i < BTN_GEAR_UP + 1; i++) {
-		if (test_bit(key_bits, i)) {
-			printf("Adding BTN: 0x%x\n", i);
-			ioctl(js_dev->uinput_fd, UI_SET_KEYBIT, i);
+	if (js_dev->state == JS_POOL_CREATING) {
+		publish_pooled(js_slot);
+		return;
+	}
+	if (js_dev->cold->remove_pending) {
+		profile_set_put(js_dev->cold->attach_profiles);
+		js_dev->cold->attach_profiles = NULL;
+		release_physical(js_dev);
+		release_virtual(js_dev);
+		return;
+	}
+	if (composite_join(js_dev, js_slot)) {
+		return;
+	}
+	int target = cfg.persist_ms ? find_detached(js_dev, JS_DETACHED) : -1;
+	if (target < 0 && cfg.pool_size) {
+		target = find_detached(js_dev, JS_POOLED);
+		if (target >= 0 && !pool_fits(js_dev, &joysticks[target])) {
+			printf("Pooled wayland joystick %d lacks output codes of the profile for %s, creating a new device\n",
+				target, js_dev->cold->event_node_name);
+			target = -1;
 		}
 	}
-#undef test_bit
-#define test_bit(array, bit) ((array[bit / (8 * sizeof(unsigned long))] >> (bit % (8 * sizeof(unsigned long)))) & 1)
-	unsigned long abs_features[BITS_TO_LONGS(ABS_CNT)];
-	memset(abs_features, 0, sizeof(abs_features));
-	if (js_dev->axes > 0) {
-		ioctl(js_dev->uinput_fd, UI_SET_EVBIT, EV_ABS);
-		memset(js_dev->axmap, 0, sizeof(js_dev->axmap));
-		ioctl(js_dev->fd, JSIOCGAXMAP, js_dev->axmap);
-		memset(abs_features, 0, sizeof(abs_features));
-		if (ioctl(js_dev->event_fd, EVIOCGBIT(EV_ABS, sizeof(abs_features)), abs_features) == -1) {
-			perror("Ioctl abs features query");
-			exit(1);
+	if (target >= 0) {
+		rebind_joystick(js_dev, &joysticks[target], target);
+		return;
+	}
+	js_dev->state = JS_CREATING;
+	attach_request(js_slot);
+}
+
+/* Closes the physical nodes and restores their permissions */
+static void release_physical(struct joystick *js_dev)
+{
+	if (js_dev->state == JS_ACTIVE) {
+		printf("EPOLL_CTL_DEL %d\n", js_dev->fd);
+		if (epoll_ctl(epollfd, EPOLL_CTL_DEL, js_dev->fd, NULL) == -1) {
+			printf("epoll_ctl: Failed to remove joystick from epoll\n");
+			exit(-1);
 		}
 	}
-	for (int i = ABS_X; i < ABS_CNT; i++) {
-		if (test_bit(abs_features, i)) {
-			printf("Adding ABS: 0x%x\n", i);
-			ioctl(js_dev->uinput_fd, UI_SET_ABSBIT, i);
+	if (js_dev->fd >= 0) {
+		fchmod(js_dev->fd, js_dev->cold->orig_mode);
+		close(js_dev->fd);
+	}
+	js_dev->fd = -1;
+	arena_free(js_dev->cold->node_name);
+	js_dev->cold->node_name = NULL;
+	pthread_mutex_lock(&js_dev->cold->ff_lock);
+	if (js_dev->cold->event_fd >= 0) {
+		fchmod(js_dev->cold->event_fd, js_dev->cold->event_orig_mode);
+		close(js_dev->cold->event_fd);
+	}
+	js_dev->cold->event_fd = -1;
+	pthread_mutex_unlock(&js_dev->cold->ff_lock);
+	arena_free(js_dev->cold->event_node_name);
+	js_dev->cold->event_node_name = NULL;
+	arena_free(js_dev->cold->last_id_path);
+	js_dev->cold->last_id_path = js_dev->cold->id_path;
+	js_dev->cold->id_path = NULL;
+}
+
+/* Destroys the uinput device and frees the rest of the slot */
+static void release_virtual(struct joystick *js_dev)
+{
+	int published = js_dev->state == JS_ACTIVE || js_dev->state == JS_DETACHED;
+
+	pthread_mutex_lock(&js_dev->cold->ff_lock);
+	for (int i = 0; i < js_dev->sinks; i++) {
+		if (published || js_dev->state == JS_POOLED) {
+			printf("EPOLL_CTL_DEL %d\n", js_dev->uinput_fd[i]);
+			if (epoll_ctl(ff_workers[js_dev - joysticks].epollfd, EPOLL_CTL_DEL, js_dev->uinput_fd[i], NULL) == -1) {
+				printf("epoll_ctl: Failed to remove uinput joystick from epoll\n");
+				exit(-1);
+			}
 		}
+		ioctl(js_dev->uinput_fd[i], UI_DEV_DESTROY);
+		close(js_dev->uinput_fd[i]);
 	}
-	/* Force Feedback */
-	unsigned long ff_features[BITS_TO_LONGS(FF_CNT)];
-	memset(ff_features, 0, sizeof(ff_features));
-	if (ioctl(js_dev->event_fd, EVIOCGBIT(EV_FF, sizeof(ff_features)), ff_features) == -1) {
-		perror("Ioctl force feedback features query");
-		exit(1);
+	js_dev->sinks = 0;
+	if (published) {
+		num_josyticks--;
 	}
-	int has_ff = 0;
-	int max_ff_effects = 0;
-	for (int i = FF_EFFECT_MIN; i < FF_CNT; i++) {
-		if (test_bit(ff_features, i)) {
-			printf("Adding Force Feedback Effect: 0x%x\n", i);
-			ioctl(js_dev->uinput_fd, UI_SET_FFBIT, i);
-			has_ff = 1;
+	arena_free(js_dev->cold->ff);
+	js_dev->cold->ff = NULL;
+	js_dev->cold->ff_slots = 0;
+	js_dev->cold->ff_gen++;
+	atomic_store(&js_dev->cold->ff_work, 0);
+	pthread_mutex_unlock(&js_dev->cold->ff_lock);
+	arena_free(js_dev->cold->last_id_path);
+	js_dev->cold->last_id_path = NULL;
+	free_transform(js_dev->xform);
+	js_dev->xform = NULL;
+	arena_free(js_dev->predict);
+	js_dev->predict = NULL;
+	arena_free(js_dev->remap);
+	js_dev->remap = NULL;
+	if (js_dev->tick_fd >= 0) {
+		close(js_dev->tick_fd);
+		js_dev->tick_fd = -1;
+	}
+	js_dev->tick_armed = 0;
+	js_dev->out_hz = 0;
+	js_dev->staged = js_dev->key_staged = 0;
+	composite_leave(js_dev);
+	js_dev->state = JS_FREE;
+}
+
+/*
+ * Keeps the virtual device of a disconnected controller alive with all
+ * inputs at rest, so a reconnect within the grace period is invisible to
+ * consumers.
+ */
+static void rest_inputs(struct joystick *js_dev)
+{
+	if (js_dev->predict) {
+		js_dev->predict->pending = 0;
+		memset(js_dev->predict->primed, 0, sizeof(js_dev->predict->primed));
+	}
+	js_dev->noise_held = 0;
+	for (int a = 0; a < js_dev->axes; a++) {
+		js_dev->axis[a] = js_dev->cold->rest[a];
+		axis_emit(js_dev, a, js_dev->cold->rest[a]);
+	}
+	buttons_emit(js_dev, (uint64_t [BUTTON_WORDS]) { 0 });
+	flush_events(js_dev);
+}
+
+static void detach_joystick(struct joystick *js_dev)
+{
+	rest_inputs(js_dev);
+	release_physical(js_dev);
+	js_dev->state = JS_DETACHED;
+	js_dev->cold->detach_deadline_us = now_us() + (uint64_t) cfg.persist_ms * 1000;
+	if (js_dev->composite) {
+		js_dev->composite->slot[0] = -1;
+		/* Kept without a deadline while other members still feed it */
+		if (composite_live(js_dev->composite)) {
+			js_dev->cold->detach_deadline_us = 0;
 		}
 	}
-	if (has_ff) {
-		ioctl(js_dev->uinput_fd, UI_SET_EVBIT, EV_FF);
-		ioctl(js_dev->event_fd, EVIOCGEFFECTS, &max_ff_effects);
+	hotplug_timer_arm();
+}
+
+static void expire_detached(void)
+{
+	uint64_t now = now_us();
+
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		struct joystick *js_dev = &joysticks[i];
+		if (js_dev->state == JS_DETACHED && js_dev->cold->detach_deadline_us && js_dev->cold->detach_deadline_us <= now) {
+			printf("Removing wayland joystick %d after grace period\n", i);
+			release_virtual(js_dev);
+		}
 	}
-#undef test_bit
-	memset(&usetup, 0, sizeof(usetup));
-	usetup.id.bustype = BUS_USB;
-	usetup.id.vendor = 0x776C;
-	usetup.id.product = 0x6A73;
-	usetup.id.version = (ushort) 0x123;
-	usetup.ff_effects_max = max_ff_effects;
-	char *js_name;
-	int size = asprintf(&js_name, "Wayland Joystick %d", js_slot);
-	strcpy(usetup.name, js_name);
-	free(js_name);
-	ioctl(js_dev->uinput_fd, UI_DEV_SETUP, &usetup);
-	ioctl(js_dev->uinput_fd, UI_DEV_CREATE);
-	printf("Successfully added wayland joystick %d: %s\n", js_slot, js_dev->event_node_name);
-	num_josyticks++;
 }
 
 static void remove_joystick(const char *node_name)
 {
 	struct joystick *js_dev = NULL;
+	pending_remove_node(node_name);
 	for (int i = 0; i < MAX_JOYSTICKS; i++) {
-		if (joysticks[i].node_name && !strcmp(node_name, joysticks[i].node_name)) {
+		if (joysticks[i].cold->node_name && !strcmp(node_name, joysticks[i].cold->node_name)) {
 			js_dev = &joysticks[i];
 		}
 	}
 	if (!js_dev) {
 		return;
 	}
-	printf("Removing %s\n", js_dev->node_name);
-	printf("EPOLL_CTL_DEL %d\n", js_dev->fd);
-	if (epoll_ctl(epollfd, EPOLL_CTL_DEL, js_dev->fd, NULL) == -1) {
-		printf("epoll_ctl: Failed to remove joystick from epoll\n");
-		exit(-1);
+	if (js_dev->state == JS_PROBING || js_dev->state == JS_CREATING ||
+		(js_dev->state == JS_MEMBER && js_dev->composite->owner >= 0)) {
+		js_dev->cold->remove_pending = 1;
+		return;
 	}
-	printf("EPOLL_CTL_DEL %d\n", js_dev->uinput_fd);
-	if (epoll_ctl(epollfd, EPOLL_CTL_DEL, js_dev->uinput_fd, NULL) == -1) {
-		printf("epoll_ctl: Failed to remove uinput joystick from epoll\n");
-		exit(-1);
+	printf("Removing %s\n", js_dev->cold->node_name);
+	if (js_dev->state == JS_MEMBER) {
+		profile_set_put(js_dev->cold->attach_profiles);
+		js_dev->cold->attach_profiles = NULL;
+		release_physical(js_dev);
+		release_virtual(js_dev);
+		return;
 	}
-	ioctl(js_dev->uinput_fd, UI_DEV_DESTROY);
-	close(js_dev->uinput_fd);
-	js_dev->uinput_fd = -1;
-	fchmod(js_dev->fd, js_dev->orig_mode);
-	close(js_dev->fd);
-	js_dev->fd = -1;
-	free(js_dev->node_name);
-	js_dev->node_name = NULL;
-	fchmod(js_dev->event_fd, js_dev->event_orig_mode);
-	close(js_dev->event_fd);
-	js_dev->event_fd = -1;
-	free(js_dev->event_node_name);
-	js_dev->event_node_name = NULL;
-	free(js_dev->axis);
-	free(js_dev->button);
-	num_josyticks--;
+	if (js_dev->composite && js_dev->composite->owner != js_dev - joysticks) {
+		/* Members have no virtual device of their own to keep */
+		rest_inputs(js_dev);
+		release_physical(js_dev);
+		release_virtual(js_dev);
+		return;
+	}
+	if (cfg.persist_ms || (js_dev->composite && composite_live(js_dev->composite) > 1)) {
+		detach_joystick(js_dev);
+		return;
+	}
+	release_physical(js_dev);
+	release_virtual(js_dev);
+}
+
+static void reload_config(void)
+{
+	if (!config_path) {
+		return;
+	}
+	if (reload.queued) {
+		reload.again = 1;
+		return;
+	}
+	reload.queued = 1;
+	attach_request(ATTACH_RELOAD);
+}
+
+/*
+ * Runs on the main loop once the attach worker has loaded the profiles.
+ * Forwarding continues with the old tables until the new set is swapped in;
+ * rebuilding a device's tables only points it at the shared curve tables.
+ */
+static void reload_done(void)
+{
+	struct profile_set *set = NULL;
+
+	reload.queued = 0;
+	if (!reload.err) {
+		set = profile_set_new(reload.head);
+		if (!set) {
+			free_profiles(reload.head);
+		}
+	}
+	reload.head = NULL;
+	if (!set) {
+		printf("Keeping previous configuration\n");
+	} else {
+		profile_set_put(profiles);
+		profiles = set;
+		for (int i = 0; i < MAX_JOYSTICKS; i++) {
+			struct joystick *js_dev = &joysticks[i];
+			if (js_dev->state != JS_ACTIVE && js_dev->state != JS_DETACHED && js_dev->state != JS_POOLED) {
+				continue;
+			}
+			/*
+			 * Output codes that were not advertised at UI_DEV_CREATE are
+			 * dropped by the kernel until the device is reattached.
+			 */
+			rebuild_tables(js_dev);
+		}
+		printf("Reloaded %s\n", config_path);
+	}
+	if (reload.again) {
+		reload.again = 0;
+		reload_config();
+	}
+}
+
+static void arena_pool_init(enum arena_kind kind, const char *name, size_t size, int count)
+{
+	arena[kind].name = name;
+	arena[kind].size = (size + 63) & ~(size_t) 63;
+	arena[kind].count = count;
+	arena_bytes += arena[kind].size * count;
+}
+
+/*
+ * Sizes every pool for all slots at once. Tables are rebuilt before the old
+ * ones are released, so a slot may briefly hold two of each.
+ */
+static void arena_init(void)
+{
+	char *base;
+
+	arena_pool_init(ARENA_STRING, "string", ARENA_STRING_MAX,
+			PENDING_SLOTS * 4 + MAX_JOYSTICKS * 5);
+	arena_pool_init(ARENA_TRANSFORM, "transform",
+			sizeof(struct transform) + ABS_CNT * sizeof(((struct transform *) 0)->lut[0]),
+			MAX_JOYSTICKS * 2);
+	arena_pool_init(ARENA_REMAP, "remap",
+			sizeof(struct remap) + (ABS_CNT + JS_MAX_BUTTONS) * sizeof(struct remap_entry),
+			MAX_JOYSTICKS * 2);
+	arena_pool_init(ARENA_PREDICTOR, "predictor", sizeof(struct predictor), MAX_JOYSTICKS * 2);
+	arena_pool_init(ARENA_FF, "force feedback", FF_MAX_EFFECTS * cfg.sinks * sizeof(struct ff_slot),
+			MAX_JOYSTICKS);
+	arena_pool_init(ARENA_COMPOSITE, "composite", sizeof(struct composite), MAX_JOYSTICKS);
+
+	/* Populated up front so resident memory does not grow later */
+	base = mmap(NULL, arena_bytes, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap arena");
+		exit(1);
+	}
+	for (int k = 0; k < ARENA_KINDS; k++) {
+		struct arena_pool *ap = &arena[k];
+		ap->base = base;
+		for (int i = ap->count - 1; i >= 0; i--) {
+			void *block = ap->base + i * ap->size;
+			*(void **) block = ap->free_list;
+			ap->free_list = block;
+		}
+		base += ap->size * ap->count;
+	}
+}
+
+/* Stops and joins the worker threads, so their slots can be released */
+static void stop_workers(pthread_t attach_thread)
+{
+	uint64_t one = 1;
+
+	atomic_store(&workers_stop, 1);
+	write(attach_request_fd, &one, sizeof(one));
+	for (int i = 0; i < MAX_JOYSTICKS; i++)
+		write(ff_workers[i].kick_fd, &one, sizeof(one));
+	pthread_join(attach_thread, NULL);
+	for (int i = 0; i < MAX_JOYSTICKS; i++)
+		pthread_join(ff_workers[i].thread, NULL);
 }
 
+/* Runs on the main loop after stop_workers() */
 static void free_resources()
 {
 	for (int i = 0; i < MAX_JOYSTICKS; i++) {
-		if (joysticks[i].node_name) {
-			remove_joystick(joysticks[i].node_name);
+		if (joysticks[i].state != JS_FREE) {
+			release_physical(&joysticks[i]);
+			release_virtual(&joysticks[i]);
 		}
 	}
 	close(epollfd);
+	close(hotplug_timer_fd);
+	hotplug_timer_fd = -1;
+	profile_set_put(profiles);
+	profiles = NULL;
+	/* A reload still in flight at exit */
+	free_profiles(reload.head);
+	caps_cache_close();
 	udev_unref(udev);
 }
 
-static void signal_handler(int signum)
+static void note_hotplug_stall(uint64_t start_us)
 {
-	free_resources();
+	uint64_t stall_us = now_us() - start_us;
+
+	if (stall_us > attach_stats.max_stall_us) {
+		attach_stats.max_stall_us = stall_us;
+	}
 }
 
-int main (void)
+/*
+ * Virtual input devices, the daemon's own outputs among them, are not
+ * duplicated. -V lets one through by name or USB id, e.g. a test source
+ * such as ff-bench's; the daemon's own id is refused even then.
+ */
+static int source_wanted(struct udev_device *dev)
 {
-	struct js_event js;
-	struct input_event ie;
+	const char *dev_path = udev_device_get_devpath(dev);
+	struct udev_device *parent;
+	const char *name, *vendor, *product;
+
+	if (!dev_path || !strstr(dev_path, "virtual"))
+		return 1;
+	parent = udev_device_get_parent_with_subsystem_devtype(dev, "input", NULL);
+	if (!parent)
+		return 0;
+	name = udev_device_get_sysattr_value(parent, "name");
+	vendor = udev_device_get_sysattr_value(parent, "id/vendor");
+	product = udev_device_get_sysattr_value(parent, "id/product");
+	if (!vendor || !product)
+		return 0;
+	int v = strtol(vendor, NULL, 16), p = strtol(product, NULL, 16);
+	if (v == OUTPUT_VENDOR && p == OUTPUT_PRODUCT)
+		return 0;
+	if (cfg.allow_vendor >= 0)
+		return v == cfg.allow_vendor && p == cfg.allow_product;
+	return cfg.allow_name && name && !strcmp(name, cfg.allow_name);
+}
+
+static void handle_hotplug(struct udev_device *dev)
+{
+	const char *node_name = udev_device_get_devnode(dev);
+	const char *dev_path = udev_device_get_devpath(dev);
+	const char *action = udev_device_get_action(dev);
+	if (node_name && source_wanted(dev) && udev_device_get_property_value(dev, "ID_INPUT_JOYSTICK")) {
+		printf("Joystick hotplug:\n");
+		printf("   Node: %s\n", node_name);
+		printf("   Subsystem: %s\n", udev_device_get_subsystem(dev));
+		printf("   Devtype: %s\n", udev_device_get_devtype(dev));
+		printf("   Devpath: %s\n", dev_path);
+		printf("   Action: %s\n", action);
+		if (!strcmp(action, "remove")) {
+			remove_joystick(node_name);
+			hotplug_timer_arm();
+		} else if (!strcmp(action, "add")) {
+			add_joystick(dev);
+		}
+	}
+}
+
+/*
+ * Forwards one read worth of js events. The read is capped at the per-pass
+ * budget, so a device flooding events gets the same share of a main loop
+ * pass as the others and its backlog is picked up by the next pass.
+ */
+static void service_joystick(struct joystick *js_dev, uint64_t wake_us)
+{
+	struct js_event batch[JS_BATCH];
+
+	/* joydev hands over everything queued, up to the budget */
+	ssize_t len = read(js_dev->fd, batch, cfg.js_budget * sizeof(batch[0]));
+	if (len < (ssize_t) sizeof(batch[0])) {
+		perror("\nwl-js: error reading");
+		return;
+	}
+	js_dev->cold->in_reads++;
+	js_dev->cold->in_events += len / sizeof(batch[0]);
+	/* More may be queued; it waits for the next pass */
+	if (len == cfg.js_budget * (ssize_t) sizeof(batch[0]))
+		js_dev->cold->in_throttled++;
+
+	uint64_t next[BUTTON_WORDS];
+	uint64_t touched = 0;
+	int moved, pressed;
+	memcpy(next, js_dev->button, sizeof(next));
+	for (int e = 0; e < len / (ssize_t) sizeof(batch[0]); e++) {
+		struct js_event *js = &batch[e];
+		int init = js->type & JS_EVENT_INIT;
+		int value = js->value;
+		switch(js->type & ~JS_EVENT_INIT) {
+		case JS_EVENT_BUTTON: {
+			uint64_t bit = 1ULL << (js->number % 64);
+			int w = js->number / 64;
+			if (js->number >= js_dev->buttons || !(next[w] & bit) == !js->value) {
+				continue;
+			}
+			/* A second transition within the batch goes out in its own frame */
+			if ((next[w] ^ js_dev->button[w]) & bit) {
+				buttons_emit(js_dev, next);
+				flush_events(js_dev);
+			}
+			next[w] ^= bit;
+			break;
+		}
+		case JS_EVENT_AXIS:
+			if (js->number >= js_dev->axes) {
+				continue;
+			}
+			js_dev->axis[js->number] = js->value;
+			if (init) {
+				js_dev->cold->rest[js->number] = js->value;
+			}
+			if (js_dev->predict) {
+				value = predictor_step(js_dev->predict, js->number, js->value, js->time, init);
+			}
+			/* Sub-noise motion produces neither an event nor output */
+			if (!axis_noise_filter(&js_dev->noise[js->number], value, init)) {
+				if (!js_dev->noise_held)
+					js_dev->noise_due_us = now_us() + NOISE_HOLD_MS * 1000;
+				js_dev->noise_held |= 1ULL << js->number;
+				continue;
+			}
+			js_dev->noise_held &= ~(1ULL << js->number);
+			js_dev->axis_in[js->number] = value;
+			touched |= 1ULL << js->number;
+			break;
+		}
+	}
+	moved = touched && axes_emit(js_dev, touched);
+	pressed = buttons_emit(js_dev, next);
+	if (!moved && !pressed) {
+		settle_wait(js_dev);
+		return;
+	}
+	flush_events(js_dev);
+	if (js_dev->predict && js_dev->predict->pending) {
+		js_dev->predict->settle_us = now_us() + js_dev->predict->lead_max_ms * 1000;
+	}
+	settle_wait(js_dev);
+	latency_add(&input_latency, now_us() - wake_us);
+
+	printf("\r");
+	if (moved) {
+		printf("Axes: ");
+		for (int i = 0; i < js_dev->axes; i++) {
+			printf("%2d:%6d ", i, js_dev->axis[i]);
+		}
+	}
+	if (pressed) {
+		printf("Buttons: ");
+		for (int i = 0; i < js_dev->buttons; i++) {
+			printf("%2d:%s ", i, button_on(js_dev, i) ? "on " : "off");
+		}
+		if (button_on(js_dev, 0)) {
+			ff_kick(js_dev, FF_WORK_RUMBLE);
+		}
+	}
+
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  -C <file>     capability cache file, or \"none\" (default %s)\n", caps_cache_path);
+	printf("  -c <file>     read device profiles from file, reloaded on SIGHUP\n");
+	printf("  -n            disable the stick jitter noise filter\n");
+	printf("  -b <percent>  noise filter hysteresis band, percent of the learned floor (default %d)\n", cfg.noise_band);
+	printf("  -p <ms>       keep virtual devices of disconnected controllers for this long (default off)\n");
+	printf("  -P <count>    keep this many pre-created virtual devices for known controller types (default 0);\n"
+	       "                until a controller binds, games see them as idle \"Wayland Joystick N\" pads\n");
+	printf("  -s <ms>       hotplug settle window before a device is attached (default %d)\n", cfg.settle_ms);
+	printf("  -e <count>    minimum force feedback effects advertised per output, raised to the device's own\n"
+	       "                limit and capped at %d (default %d)\n", FF_MAX_EFFECTS, cfg.ff_effects);
+	printf("  -f <hz>       maximum force feedback update rate per device, 0 for none (default %d)\n", cfg.ff_rate_hz);
+	printf("  -t            play effect timing of rumble devices in software\n");
+	printf("  -o <count>    virtual devices fed by each controller (default %d, at most %d)\n", cfg.sinks, MAX_SINKS);
+	printf("  -a <mode>     force feedback of several outputs: priority, mix or last (default priority)\n");
+	printf("  -B <count>    js events read from one device per main loop pass (default and at most %d)\n", JS_BATCH);
+	printf("  -V <id|name>  also duplicate this virtual device, by vendor:product in hex or by name\n");
+	printf("  -K            time the axis transform kernels against the per-event path and exit\n");
+	printf("  -R            time the remap dispatch against direct forwarding and exit\n");
+	printf("  -h            show this help\n");
+	printf("Send SIGUSR1 to print per-axis statistics, SIGHUP to reload the profiles.\n");
+}
 
+int main(int argc, char *argv[])
+{
 	struct udev_enumerate *enumerate;
 	struct udev_list_entry *devices, *dev_list_entry;
 	struct udev_device *dev;
-	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event events[MAIN_EVENTS];
+	int bench_kernels = 0, bench_remap = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "C:c:nb:p:P:s:e:f:to:a:B:V:KRh")) != -1) {
+		switch (opt) {
+		case 'C':
+			caps_cache_path = optarg;
+			break;
+		case 'c':
+			config_path = optarg;
+			break;
+		case 'n':
+			cfg.noise_filter = 0;
+			break;
+		case 'b':
+			cfg.noise_band = atoi(optarg);
+			break;
+		case 'p':
+			cfg.persist_ms = atoi(optarg);
+			break;
+		case 'P':
+			cfg.pool_size = atoi(optarg);
+			if (cfg.pool_size < 0 || cfg.pool_size > POOL_MAX) {
+				cfg.pool_size = POOL_MAX;
+			}
+			break;
+		case 's':
+			cfg.settle_ms = atoi(optarg);
+			break;
+		case 'e':
+			cfg.ff_effects = atoi(optarg);
+			if (cfg.ff_effects < 0 || cfg.ff_effects > FF_MAX_EFFECTS) {
+				cfg.ff_effects = FF_MAX_EFFECTS;
+			}
+			break;
+		case 'f':
+			cfg.ff_rate_hz = atoi(optarg);
+			if (cfg.ff_rate_hz < 0) {
+				cfg.ff_rate_hz = 0;
+			}
+			break;
+		case 't':
+			cfg.ff_soft_timing = 1;
+			break;
+		case 'o':
+			cfg.sinks = atoi(optarg);
+			if (cfg.sinks < 1 || cfg.sinks > MAX_SINKS) {
+				cfg.sinks = cfg.sinks < 1 ? 1 : MAX_SINKS;
+			}
+			break;
+		case 'a':
+			if (!strcmp(optarg, "priority")) {
+				cfg.ff_arbitration = FF_ARB_PRIORITY;
+			} else if (!strcmp(optarg, "mix")) {
+				cfg.ff_arbitration = FF_ARB_MIX;
+			} else if (!strcmp(optarg, "last")) {
+				cfg.ff_arbitration = FF_ARB_LAST;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'B':
+			cfg.js_budget = atoi(optarg);
+			if (cfg.js_budget < 1 || cfg.js_budget > JS_BATCH) {
+				cfg.js_budget = cfg.js_budget < 1 ? 1 : JS_BATCH;
+			}
+			break;
+		case 'V':
+			if (sscanf(optarg, "%x:%x", &cfg.allow_vendor, &cfg.allow_product) != 2) {
+				cfg.allow_vendor = cfg.allow_product = -1;
+				cfg.allow_name = optarg;
+			}
+			break;
+		case 'K':
+			bench_kernels = 1;
+			break;
+		case 'R':
+			bench_remap = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (config_path) {
+		int err;
+		struct profile *head = load_profiles(config_path, &err);
+		if (err) {
+			exit(1);
+		}
+		profiles = profile_set_new(head);
+		if (!profiles) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+
+	arena_init();
+	axis_kernel_select();
+	if (bench_kernels || bench_remap) {
+		if (bench_kernels)
+			axis_kernel_bench();
+		if (bench_remap)
+			remap_bench();
+		return 0;
+	}
+	caps_cache_open();
+	pool_seed();
 
 	epollfd = epoll_create1(0);
 	if (epollfd == -1) {
@@ -359,21 +5077,73 @@ int main (void)
 		exit(1);
 	}
 
+	/*
+	 * Threads inherit the mask, so block the signals read from the
+	 * signalfd before any is created; otherwise the kernel may deliver
+	 * one to a worker and its default action ends the daemon.
+	 */
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGUSR1);
+	sigaddset(&sigmask, SIGHUP);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+	attach_request_fd = eventfd(0, EFD_CLOEXEC);
+	attach_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.fd = attach_done_fd;
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, attach_done_fd, &ev) == -1) {
+		printf("epoll_ctl: Failed to add attach completion fd\n");
+		exit(-1);
+	}
+	pthread_t attach_thread;
+	if (pthread_create(&attach_thread, NULL, attach_worker, NULL)) {
+		printf("Can't create attach worker\n");
+		exit(1);
+	}
+
 	enumerate = udev_enumerate_new(udev);
 	udev_enumerate_add_match_property(enumerate, "ID_INPUT_JOYSTICK", "1");
 	udev_enumerate_scan_devices(enumerate);
 	devices = udev_enumerate_get_list_entry(enumerate);
         memset(joysticks, 0, sizeof(joysticks));
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		joysticks[i].cold = &joystick_cold[i];
+		pthread_mutex_init(&joysticks[i].cold->ff_lock, NULL);
+		joysticks[i].tick_fd = -1;
+	}
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		if (ff_worker_start(i)) {
+			printf("Can't create force feedback worker\n");
+			exit(1);
+		}
+	}
 	udev_list_entry_foreach(dev_list_entry, devices) {
 		const char *path;
 
 		path = udev_list_entry_get_name(dev_list_entry);
 		dev = udev_device_new_from_syspath(udev, path);
-		add_joystick(dev);
+		if (dev && source_wanted(dev))
+			add_joystick(dev);
 		udev_device_unref(dev);
 	}
 
 	udev_enumerate_unref(enumerate);
+	pending_service(1);
+	pool_refill();
+
+	hotplug_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = hotplug_timer_fd;
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, hotplug_timer_fd, &ev) == -1) {
+		printf("epoll_ctl: Failed to add hotplug timer\n");
+		exit(-1);
+	}
+	hotplug_timer_arm();
 
 	struct udev_monitor *mon = udev_monitor_new_from_netlink(udev, "udev");
 	udev_monitor_filter_add_match_subsystem_devtype(mon, "input", NULL);
@@ -388,148 +5158,118 @@ int main (void)
 		exit(-1);
 	}
 
-	signal(SIGINT, signal_handler);
+	int sig_fd = signalfd(-1, &sigmask, SFD_CLOEXEC);
 
-	while (1) {
-		int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+	ev.events = EPOLLIN;
+	ev.data.fd = sig_fd;
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sig_fd, &ev) == -1) {
+		printf("epoll_ctl: Failed to add signal fd\n");
+		exit(-1);
+	}
+
+	int sched_first = 0;
+	int running = 1;
+	while (running) {
+		int nfds = epoll_wait(epollfd, events, MAIN_EVENTS, -1);
 		if (nfds == -1) {
 			perror("epoll_wait");
 			exit(EXIT_FAILURE);
 		}
+		uint64_t wake_us = loop_wake_us = now_us();
+		int ready_fd[MAX_JOYSTICKS];
 
+		/*
+		 * Hotplug, signals and output ticks are handled as they come;
+		 * devices with input wait until the end of the pass and are
+		 * then served in an order that rotates every pass.
+		 */
+		for (int i = 0; i < MAX_JOYSTICKS; i++) {
+			ready_fd[i] = -1;
+		}
 		for (int n = 0; n < nfds; ++n) {
 			if (events[n].data.fd == udev_mon_fd) {
-				struct udev_device *dev = udev_monitor_receive_device(mon);
-				if (dev) {
-					const char *node_name = udev_device_get_devnode(dev);
-					const char *dev_path = udev_device_get_devpath(dev);
-					const char *action = udev_device_get_action(dev);
-					if (node_name && !strstr(dev_path, "virtual") && udev_device_get_property_value(dev, "ID_INPUT_JOYSTICK")) {
-						printf("Joystick hotplug:\n");
-						printf("   Node: %s\n", node_name);
-						printf("   Subsystem: %s\n", udev_device_get_subsystem(dev));
-						printf("   Devtype: %s\n", udev_device_get_devtype(dev));
-						printf("   Devpath: %s\n", dev_path);
-						printf("   Action: %s\n", action);
-						if (!strcmp(action, "remove") && !strncmp(node_name, "/dev/input/js", strlen("/dev/input/js"))) {
-							remove_joystick(node_name);
-						} else if (!strcmp(action, "add") &&
-							(!strncmp(node_name, "/dev/input/js", strlen("/dev/input/js")) ||
-							!strncmp(node_name, "/dev/input/event", strlen("/dev/input/event")))) {
-							add_joystick(dev);
-						}
-					}
+				uint64_t start_us = now_us();
+				/* Drain everything queued so a burst is handled in one pass */
+				struct udev_device *dev;
+				while ((dev = udev_monitor_receive_device(mon))) {
+					handle_hotplug(dev);
 					udev_device_unref(dev);
 				}
-				else {
-					printf("No Device from receive_device(). An error occured.\n");
+				note_hotplug_stall(start_us);
+				continue;
+			}
+			if (events[n].data.fd == hotplug_timer_fd) {
+				uint64_t start_us = now_us();
+				uint64_t expirations;
+				read(hotplug_timer_fd, &expirations, sizeof(expirations));
+				pending_service(0);
+				expire_detached();
+				hotplug_timer_arm();
+				note_hotplug_stall(start_us);
+				continue;
+			}
+			if (events[n].data.fd == attach_done_fd) {
+				uint64_t start_us = now_us();
+				uint64_t count;
+				int slot;
+				read(attach_done_fd, &count, sizeof(count));
+				while (!ring_pop(&attach_done, &slot)) {
+					if (slot == ATTACH_RELOAD) {
+						reload_done();
+					} else {
+						attach_step_done(slot);
+					}
+				}
+				note_hotplug_stall(start_us);
+				continue;
+			}
+			if (events[n].data.fd == sig_fd) {
+				struct signalfd_siginfo si;
+				if (read(sig_fd, &si, sizeof(si)) != sizeof(si)) {
+					continue;
+				}
+				if (si.ssi_signo == SIGUSR1) {
+					print_stats();
+				} else if (si.ssi_signo == SIGHUP) {
+					reload_config();
+				} else {
+					running = 0;
 				}
 				continue;
 			}
 			struct joystick *js_dev = NULL;
-			struct joystick *ev_dev = NULL;
-			for (int i = 0; i < num_josyticks; i++) {
-				if (events[n].data.fd == joysticks[i].fd) {
+			for (int i = 0; i < MAX_JOYSTICKS; i++) {
+				if (joysticks[i].tick_fd >= 0 && events[n].data.fd == joysticks[i].tick_fd) {
 					js_dev = &joysticks[i];
 					break;
-				} else if (events[n].data.fd == joysticks[i].uinput_fd) {
-					ev_dev = &joysticks[i];
-					break;
 				}
 			}
 			if (js_dev) {
-				if (read(events[n].data.fd, &js, sizeof(struct js_event)) != sizeof(struct js_event)) {
-					perror("\nwl-js: error reading");
-					continue;
-				}
-			} else if (ev_dev) {
-				if (read(events[n].data.fd, &ie, sizeof(struct input_event)) != sizeof(struct input_event)) {
-					perror("\nwl-js: error reading");
-					continue;
-				}
-				if (ie.type == EV_UINPUT) {
-					if (ie.code == UI_FF_UPLOAD) {
-						struct uinput_ff_upload upload_data;
-						memset(&upload_data, 0, sizeof(upload_data));
-						upload_data.request_id = ie.value;
-						ioctl(ev_dev->uinput_fd, UI_BEGIN_FF_UPLOAD, &upload_data);
-						ioctl(ev_dev->event_fd, EVIOCRMFF, upload_data.effect.id);
-						upload_data.effect.id = -1;
-						ioctl(ev_dev->event_fd, EVIOCSFF, &upload_data.effect);
-						upload_data.retval = 0;
-						ioctl(ev_dev->uinput_fd, UI_END_FF_UPLOAD, &upload_data);
-					} else if (ie.code == UI_FF_ERASE) {
-						struct uinput_ff_erase erase_data;
-						memset(&erase_data, 0, sizeof(erase_data));
-						erase_data.request_id = ie.value;
-						ioctl(ev_dev->uinput_fd, UI_BEGIN_FF_ERASE, &erase_data);
-						ioctl(ev_dev->event_fd, EVIOCRMFF, erase_data.effect_id);
-						erase_data.retval = 0;
-						ioctl(ev_dev->uinput_fd, UI_END_FF_ERASE, &erase_data);
-					}
-				} else if (ie.type == EV_FF) {
-					if (ie.code == FF_GAIN) {
-						printf("Setting force feedback gain to %d%% ... \n", (int)(((ie.value * 1.0f) / 0xFFFF) * 100));
-					} else if (ie.value) {
-						printf("Playing rumble effect code 0x%x value 0x%x on event fd %d..\n", ie.code, ie.value, ev_dev->event_fd);
-					}
-					write(ev_dev->event_fd, (const void*) &ie, sizeof(ie));
-				}
-				continue;
-			} else {
+				uint64_t expirations;
+				read(js_dev->tick_fd, &expirations, sizeof(expirations));
+				output_tick(js_dev);
 				continue;
 			}
-
-			switch(js.type & ~JS_EVENT_INIT) {
-			case JS_EVENT_BUTTON:
-				js_dev->button[js.number] = js.value;
-				break;
-			case JS_EVENT_AXIS:
-				js_dev->axis[js.number] = js.value;
-				break;
-			}
-
-			printf("\r");
-
-			if (js_dev->axes) {
-				emit(js_dev->uinput_fd, EV_ABS, ABS_X + js_dev->axmap[js.number], js_dev->axis[js.number]);
-				emit(js_dev->uinput_fd, EV_SYN, SYN_REPORT, 0);
-				printf("Axes: ");
-				for (int i = 0; i < js_dev->axes; i++) {
-					printf("%2d:%6d ", i, js_dev->axis[i]);
+			for (int i = 0; i < MAX_JOYSTICKS; i++) {
+				if (joysticks[i].state == JS_ACTIVE && events[n].data.fd == joysticks[i].fd) {
+					ready_fd[i] = joysticks[i].fd;
+					break;
 				}
 			}
-
-			if (js_dev->buttons) {
-				emit(js_dev->uinput_fd, EV_KEY, js_dev->btnmap[js.number], js_dev->button[js.number]);
-				emit(js_dev->uinput_fd, EV_SYN, SYN_REPORT, 0);
-				printf("Buttons: ");
-				for (int i = 0; i < js_dev->buttons; i++) {
-					printf("%2d:%s ", i, js_dev->button[i] ? "on " : "off");
-					if (!i && js_dev->button[i]) {
-						struct input_event play;
-						memset(&play, 0, sizeof(play));
-						ioctl(js_dev->event_fd, EVIOCRMFF, js_dev->rumble_effect.id);
-						memset(&js_dev->rumble_effect, 0, sizeof(js_dev->rumble_effect));
-						js_dev->rumble_effect.type = FF_RUMBLE;
-						js_dev->rumble_effect.id = -1;
-						js_dev->rumble_effect.u.rumble.strong_magnitude = 0x8000;
-						js_dev->rumble_effect.u.rumble.weak_magnitude = 0;
-						js_dev->rumble_effect.replay.length = 500;
-						js_dev->rumble_effect.replay.delay = 0;
-						ioctl(js_dev->event_fd, EVIOCSFF, &js_dev->rumble_effect);
-						play.type = EV_FF;
-						play.code = js_dev->rumble_effect.id;
-						play.value = 1;
-						write(js_dev->event_fd, (const void*) &play, sizeof(play));
-					}
-				}
+		}
+		for (int k = 0; k < MAX_JOYSTICKS; k++) {
+			int i = (sched_first + k) % MAX_JOYSTICKS;
+			/* Hotplug handling above may have released the slot */
+			if (ready_fd[i] >= 0 && joysticks[i].state == JS_ACTIVE && joysticks[i].fd == ready_fd[i]) {
+				service_joystick(&joysticks[i], wake_us);
 			}
-
-			fflush(stdout);
 		}
+		sched_first = (sched_first + 1) % MAX_JOYSTICKS;
+		composite_flush();
 	}
 
+	stop_workers(attach_thread);
 	free_resources();
 
 	return 0;
@@ -0,0 +1,448 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Scott Moreau <oreaus@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// gcc -o ff-bench ff-bench.c -lpthread
+
+/*
+ * Force feedback round trip benchmark for dup-joysticks.
+ *
+ * Creates a uinput joystick with rumble as a stand-in for a physical
+ * controller and waits for dup-joysticks to duplicate it. It then acts as
+ * a consumer of the "Wayland Joystick N" node: rumble effects are uploaded,
+ * played, updated, played again and erased, paced at each rate of a sweep.
+ * Every operation is timed from the consumer's call until the matching
+ * request reaches the stand-in device. Uploads and plays carry a tag in
+ * the strong magnitude and the play count; erases are matched in order.
+ *
+ * The source is a virtual device, which the daemon skips unless told by -V
+ * to take it. Run as root with the daemon already up:
+ *	./dup-joysticks -V 1209:0ffb -f 0 &	raw round trips, no FF rate limit
+ *	./ff-bench -r 10,100,1000
+ * Running the daemon with its default -f shows what coalescing adds. Its
+ * SIGUSR1 statistics break the same operations down per device call.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#define MAX_RATES 16
+/* Id of the source device, to pass to dup-joysticks -V */
+#define SOURCE_VENDOR 0x1209
+#define SOURCE_PRODUCT 0x0ffb
+/* Tags stay below the 0x8000 magnitude of the daemon's demo rumble */
+#define MAX_TAG 0x7fff
+/* An operation that has not reached the device by then is counted lost */
+#define SETTLE_MS 1000
+
+enum op_kind {
+	OP_UPLOAD,
+	OP_UPDATE,
+	OP_PLAY,
+	OP_ERASE,
+	OP_KINDS
+};
+
+static const char *op_names[OP_KINDS] = { "Upload", "Update", "Play", "Erase" };
+
+static int src_fd = -1;
+static atomic_int stop;
+
+/* Written by the source thread, read once a rate has settled */
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t seen_upload[MAX_TAG + 1], seen_play[MAX_TAG + 1];
+static uint64_t seen_erase[MAX_TAG + 1];
+static int erases_seen;
+static unsigned long source_ops;
+
+static uint64_t sent[OP_KINDS][MAX_TAG + 1];
+static int sent_count[OP_KINDS];
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int source_create(void)
+{
+	struct uinput_setup usetup;
+	struct uinput_abs_setup abs;
+	int fd = open("/dev/uinput", O_RDWR);
+
+	if (fd == -1) {
+		perror("open /dev/uinput");
+		return -1;
+	}
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_KEYBIT, BTN_TRIGGER);
+	ioctl(fd, UI_SET_KEYBIT, BTN_THUMB);
+	ioctl(fd, UI_SET_EVBIT, EV_ABS);
+	for (int code = ABS_X; code <= ABS_Y; code++) {
+		memset(&abs, 0, sizeof(abs));
+		abs.code = code;
+		abs.absinfo.minimum = -32767;
+		abs.absinfo.maximum = 32767;
+		ioctl(fd, UI_SET_ABSBIT, code);
+		ioctl(fd, UI_ABS_SETUP, &abs);
+	}
+	ioctl(fd, UI_SET_EVBIT, EV_FF);
+	ioctl(fd, UI_SET_FFBIT, FF_RUMBLE);
+
+	memset(&usetup, 0, sizeof(usetup));
+	usetup.id.bustype = BUS_VIRTUAL;
+	usetup.id.vendor = SOURCE_VENDOR;
+	usetup.id.product = SOURCE_PRODUCT;
+	usetup.ff_effects_max = 16;
+	strcpy(usetup.name, "ff-bench source");
+	if (ioctl(fd, UI_DEV_SETUP, &usetup) == -1 || ioctl(fd, UI_DEV_CREATE) == -1) {
+		perror("create source device");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void source_key(int code, int value)
+{
+	struct input_event ie[2];
+
+	memset(ie, 0, sizeof(ie));
+	ie[0].type = EV_KEY;
+	ie[0].code = code;
+	ie[0].value = value;
+	ie[1].type = EV_SYN;
+	ie[1].code = SYN_REPORT;
+	write(src_fd, ie, sizeof(ie));
+}
+
+/* Plays the physical controller: accepts every request and notes its arrival */
+static void *source_serve(void *arg)
+{
+	struct input_event ev[64];
+
+	while (!atomic_load(&stop)) {
+		struct pollfd pfd = { .fd = src_fd, .events = POLLIN };
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		ssize_t len = read(src_fd, ev, sizeof(ev));
+		for (int i = 0; i < len / (ssize_t) sizeof(ev[0]); i++) {
+			uint64_t now = now_us();
+			if (ev[i].type == EV_UINPUT && ev[i].code == UI_FF_UPLOAD) {
+				struct uinput_ff_upload up = { .request_id = ev[i].value };
+				ioctl(src_fd, UI_BEGIN_FF_UPLOAD, &up);
+				int tag = up.effect.u.rumble.strong_magnitude;
+				pthread_mutex_lock(&seen_lock);
+				if (tag <= MAX_TAG && !seen_upload[tag])
+					seen_upload[tag] = now;
+				source_ops++;
+				pthread_mutex_unlock(&seen_lock);
+				up.retval = 0;
+				ioctl(src_fd, UI_END_FF_UPLOAD, &up);
+			} else if (ev[i].type == EV_UINPUT && ev[i].code == UI_FF_ERASE) {
+				struct uinput_ff_erase er = { .request_id = ev[i].value };
+				ioctl(src_fd, UI_BEGIN_FF_ERASE, &er);
+				pthread_mutex_lock(&seen_lock);
+				if (erases_seen <= MAX_TAG)
+					seen_erase[erases_seen++] = now;
+				source_ops++;
+				pthread_mutex_unlock(&seen_lock);
+				er.retval = 0;
+				ioctl(src_fd, UI_END_FF_ERASE, &er);
+			} else if (ev[i].type == EV_FF && ev[i].code < FF_GAIN) {
+				pthread_mutex_lock(&seen_lock);
+				if (ev[i].value > 0 && ev[i].value <= MAX_TAG && !seen_play[ev[i].value])
+					seen_play[ev[i].value] = now;
+				source_ops++;
+				pthread_mutex_unlock(&seen_lock);
+			}
+		}
+	}
+	return NULL;
+}
+
+static int is_virtual_node(int fd)
+{
+	char name[256] = "";
+
+	ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+	return !strncmp(name, "Wayland Joystick ", strlen("Wayland Joystick ")) && !strstr(name, "output");
+}
+
+/*
+ * Presses button 1 of the source until one of the virtual devices reports
+ * it; button 0 would start the daemon's demo rumble. A pooled device may
+ * have existed before the source, so node names alone do not tell.
+ */
+static int find_virtual(int timeout_ms)
+{
+	char path[64][sizeof("/dev/input/") + 256];
+	uint64_t deadline = now_us() + (uint64_t) timeout_ms * 1000;
+	int found = -1, press = 1;
+
+	while (found < 0 && now_us() < deadline) {
+		int fds[64], nfds = 0;
+		DIR *dir = opendir("/dev/input");
+		struct dirent *de;
+
+		while (dir && (de = readdir(dir)) && nfds < 64) {
+			if (strncmp(de->d_name, "event", 5))
+				continue;
+			snprintf(path[nfds], sizeof(path[nfds]), "/dev/input/%s", de->d_name);
+			int fd = open(path[nfds], O_RDONLY | O_NONBLOCK);
+			if (fd < 0)
+				continue;
+			if (is_virtual_node(fd))
+				fds[nfds++] = fd;
+			else
+				close(fd);
+		}
+		if (dir)
+			closedir(dir);
+		source_key(BTN_THUMB, press);
+		press = !press;
+		usleep(200000);
+		for (int i = 0; i < nfds; i++) {
+			struct input_event ie;
+			while (found < 0 && read(fds[i], &ie, sizeof(ie)) == sizeof(ie)) {
+				if (ie.type == EV_KEY)
+					found = i;
+			}
+			close(fds[i]);
+		}
+		if (found >= 0) {
+			source_key(BTN_THUMB, 0);
+			printf("Virtual device: %s\n", path[found]);
+			return open(path[found], O_RDWR);
+		}
+	}
+	return -1;
+}
+
+static void pace(uint64_t start_ns, unsigned long op, int rate)
+{
+	uint64_t at = start_ns + (uint64_t) op * 1000000000 / rate;
+	struct timespec ts = { .tv_sec = at / 1000000000, .tv_nsec = at % 1000000000 };
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, uint64_t *lat, int n, int sent)
+{
+	if (!n) {
+		printf("   %-7s %5d sent, none reached the device\n", what, sent);
+		return;
+	}
+	qsort(lat, n, sizeof(lat[0]), cmp_u64);
+	printf("   %-7s %5d sent, %5d lost, p50 %5lu us, p90 %5lu us, p99 %5lu us, max %5lu us\n",
+		what, sent, sent - n, (unsigned long) lat[n * 50 / 100], (unsigned long) lat[n * 90 / 100],
+		(unsigned long) lat[n * 99 / 100], (unsigned long) lat[n - 1]);
+}
+
+static void send_play(int vfd, int id, int tag)
+{
+	struct input_event play;
+
+	memset(&play, 0, sizeof(play));
+	play.type = EV_FF;
+	play.code = id;
+	play.value = tag;
+	sent[OP_PLAY][tag] = now_us();
+	sent_count[OP_PLAY]++;
+	write(vfd, &play, sizeof(play));
+}
+
+static void send_upload(int vfd, struct ff_effect *effect, enum op_kind kind, int tag)
+{
+	effect->u.rumble.strong_magnitude = tag;
+	sent[kind][tag] = now_us();
+	sent_count[kind]++;
+	if (ioctl(vfd, EVIOCSFF, effect) == -1)
+		perror("EVIOCSFF");
+}
+
+/* Latencies of the tagged operations of one kind that reached the device */
+static int match_tags(uint64_t *lat, enum op_kind kind, const uint64_t *seen, int tags)
+{
+	int n = 0;
+
+	for (int t = 1; t < tags; t++) {
+		if (sent[kind][t] && seen[t] >= sent[kind][t])
+			lat[n++] = seen[t] - sent[kind][t];
+	}
+	return n;
+}
+
+/*
+ * One cycle is upload, play, update, play, erase, each a separate
+ * operation paced at the given rate. The upload and its first play carry
+ * one tag, the update and the second play the next.
+ */
+static void run_rate(int vfd, int rate, int cycles)
+{
+	static uint64_t lat[MAX_TAG + 1];
+	struct timespec ts;
+	unsigned long op = 0, ops_before, requests;
+	int tag = 1, n;
+
+	pthread_mutex_lock(&seen_lock);
+	memset(seen_upload, 0, sizeof(seen_upload));
+	memset(seen_play, 0, sizeof(seen_play));
+	erases_seen = 0;
+	ops_before = source_ops;
+	pthread_mutex_unlock(&seen_lock);
+	memset(sent, 0, sizeof(sent));
+	memset(sent_count, 0, sizeof(sent_count));
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t start_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	for (int c = 0; c < cycles && tag + 1 <= MAX_TAG; c++, tag += 2) {
+		struct ff_effect effect;
+
+		memset(&effect, 0, sizeof(effect));
+		effect.type = FF_RUMBLE;
+		effect.id = -1;
+		effect.replay.length = 20;
+		effect.u.rumble.weak_magnitude = 0x4000;
+
+		pace(start_ns, op++, rate);
+		send_upload(vfd, &effect, OP_UPLOAD, tag);
+		pace(start_ns, op++, rate);
+		send_play(vfd, effect.id, tag);
+		pace(start_ns, op++, rate);
+		send_upload(vfd, &effect, OP_UPDATE, tag + 1);
+		pace(start_ns, op++, rate);
+		send_play(vfd, effect.id, tag + 1);
+		pace(start_ns, op++, rate);
+		sent[OP_ERASE][sent_count[OP_ERASE]++] = now_us();
+		ioctl(vfd, EVIOCRMFF, effect.id);
+	}
+	usleep(SETTLE_MS * 1000);
+
+	printf("%d operations per second, %d cycles\n", rate, sent_count[OP_ERASE]);
+	pthread_mutex_lock(&seen_lock);
+	n = match_tags(lat, OP_UPLOAD, seen_upload, tag);
+	report(op_names[OP_UPLOAD], lat, n, sent_count[OP_UPLOAD]);
+	n = match_tags(lat, OP_UPDATE, seen_upload, tag);
+	report(op_names[OP_UPDATE], lat, n, sent_count[OP_UPDATE]);
+	n = match_tags(lat, OP_PLAY, seen_play, tag);
+	report(op_names[OP_PLAY], lat, n, sent_count[OP_PLAY]);
+	/* Erases carry no tag and are matched in order */
+	n = 0;
+	for (int i = 0; i < sent_count[OP_ERASE] && i < erases_seen; i++) {
+		if (seen_erase[i] >= sent[OP_ERASE][i])
+			lat[n++] = seen_erase[i] - sent[OP_ERASE][i];
+	}
+	report(op_names[OP_ERASE], lat, n, sent_count[OP_ERASE]);
+	requests = source_ops - ops_before;
+	pthread_mutex_unlock(&seen_lock);
+	printf("   %lu device requests for %lu operations, %lu.%02lu each\n",
+		requests, op, requests / op, requests * 100 / op % 100);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  -r <list>     operation rates per second, comma separated (default 10,100,1000)\n");
+	printf("  -n <count>    upload, play, update, play, erase cycles per rate (default 200)\n");
+	printf("  -w <ms>       how long to wait for dup-joysticks to duplicate the source (default 10000)\n");
+	printf("  -h            show this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int rates[MAX_RATES] = { 10, 100, 1000 }, nrates = 3;
+	int cycles = 200, wait_ms = 10000;
+	pthread_t thread;
+	int opt, vfd;
+
+	while ((opt = getopt(argc, argv, "r:n:w:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			nrates = 0;
+			for (char *tok = strtok(optarg, ","); tok && nrates < MAX_RATES; tok = strtok(NULL, ",")) {
+				if (atoi(tok) > 0)
+					rates[nrates++] = atoi(tok);
+			}
+			break;
+		case 'n':
+			cycles = atoi(optarg);
+			if (cycles < 1 || cycles > MAX_TAG / 2) {
+				cycles = cycles < 1 ? 1 : MAX_TAG / 2;
+			}
+			break;
+		case 'w':
+			wait_ms = atoi(optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	src_fd = source_create();
+	if (src_fd < 0)
+		return 1;
+	if (pthread_create(&thread, NULL, source_serve, NULL)) {
+		printf("Can't create source thread\n");
+		return 1;
+	}
+	vfd = find_virtual(wait_ms);
+	if (vfd < 0) {
+		printf("No virtual device showed input from the source; is dup-joysticks running with -V %04x:%04x?\n",
+		       SOURCE_VENDOR, SOURCE_PRODUCT);
+	} else {
+		for (int i = 0; i < nrates; i++)
+			run_rate(vfd, rates[i], cycles);
+		close(vfd);
+	}
+	atomic_store(&stop, 1);
+	pthread_join(thread, NULL);
+	ioctl(src_fd, UI_DEV_DESTROY);
+	close(src_fd);
+	return vfd < 0;
+}
@@ -0,0 +1,1102 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Scott Moreau <oreaus@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// gcc -o load-bench load-bench.c -lpthread
+
+/*
+ * Load benchmark for dup-joysticks.
+ *
+ * Runs the daemon's own main() in this process against simulated devices,
+ * so whole-daemon behaviour under load can be measured without hardware,
+ * root or uinput. This file answers every libudev call the daemon makes,
+ * and open(), stat(), chmod(), ioctl() and write() on the jsN, eventN and
+ * uinput nodes of the simulated pads. Each node is one end of a socket
+ * pair. The benchmark writes js events and reads the frames of the virtual
+ * devices from the other end, and sends force feedback requests the way
+ * the uinput core does. Device calls that take time on real hardware sleep
+ * for a modeled cost, set with the options below.
+ *
+ * Only the daemon's external interface is used, so the same file builds
+ * against older revisions of dup-joysticks.c for before/after numbers:
+ *	git show <rev>:dup-joysticks.c > /tmp/old/dup-joysticks.c
+ *	cp load-bench.c /tmp/old && gcc -o old-bench /tmp/old/load-bench.c -lpthread
+ *
+ *	./load-bench hotplug		input latency while pads are plugged in
+ *	./load-bench rumble		physical ioctls per rumble update
+ *	./load-bench storm		latency of one pad while another rumbles
+ *	./load-bench flood		button and axis latency under an axis flood
+ *
+ * Arguments after -- are passed to the daemon.
+ */
+
+#define main dup_joysticks_main
+#include "dup-joysticks.c"
+#undef main
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define SIM_PADS 8
+#define SIM_AXES 6
+#define SIM_BUTTONS 12
+#define SIM_EFFECTS 16
+#define SIM_FDS 1024
+/* Button used to find a pad's virtual device; button 0 played a demo rumble */
+#define SIM_ID_BUTTON 3
+
+/* Modeled cost of the device calls, microseconds */
+static struct {
+	int open_us;		/* opening an event node: USB resume */
+	int create_us;		/* UI_DEV_CREATE: input core registration */
+	int ff_us;		/* EVIOCSFF and EVIOCRMFF: a report to the pad */
+} cost = {
+	.open_us = 2000,
+	.create_us = 10000,
+	.ff_us = 4000,
+};
+
+/* A virtual device the daemon created through /dev/uinput */
+struct sim_out {
+	int fd;			/* benchmark end */
+	int n;
+	atomic_int created;
+	/* The force feedback request in flight, see ff_request() */
+	int req_code;
+	struct ff_effect req_effect;
+	struct ff_effect effect[SIM_EFFECTS];
+	atomic_uint req_seq;
+	atomic_uint ended;
+};
+
+struct sim_pad {
+	char js_node[32], event_node[32], syspath[96], devpath[96], id_path[64];
+	int js_fd;		/* benchmark end of the js node */
+	int event_fd;		/* benchmark end of the event node */
+	atomic_int opened;
+	atomic_int sff, rmff;	/* EVIOCSFF and EVIOCRMFF calls */
+	atomic_int ff_writes;	/* EV_FF events written to the event node */
+	int next_id;
+	struct sim_out *out;
+};
+
+enum sim_kind {
+	SIM_NONE,
+	SIM_JS,
+	SIM_EVENT,
+	SIM_UINPUT,
+};
+
+static struct {
+	enum sim_kind kind;
+	struct sim_pad *pad;
+	struct sim_out *out;
+} sim_fd[SIM_FDS];
+
+static struct sim_pad pads[SIM_PADS];
+static struct sim_out *outs[SIM_FDS];
+static int nouts;
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *out;
+
+static uint64_t lb_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lb_sleep_us(int us)
+{
+	struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+
+	while (us > 0 && clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+		;
+}
+
+/* libudev: a monitor queue filled by the benchmark, no enumerated devices */
+struct udev {
+	int unused;
+};
+
+struct udev_list_entry {
+	const char *name, *value;
+	struct udev_list_entry *next;
+};
+
+struct udev_device {
+	struct udev_device *parent;	/* owned by the child */
+	char devnode[32], syspath[192], devpath[160], action[8], id_path[64];
+	const char *vendor, *product;
+	struct udev_list_entry prop[3];
+};
+
+struct udev_monitor {
+	int rfd, wfd;
+	struct udev_device *queue[64];
+	unsigned int head, tail;
+};
+
+struct udev_enumerate {
+	int unused;
+};
+
+static struct udev sim_udev;
+static struct udev_monitor sim_monitor = { -1, -1 };
+static struct udev_enumerate sim_enumerate;
+
+struct udev *udev_new(void)
+{
+	return &sim_udev;
+}
+
+struct udev *udev_unref(struct udev *udev)
+{
+	return NULL;
+}
+
+const char *udev_device_get_devnode(struct udev_device *dev)
+{
+	return dev->devnode[0] ? dev->devnode : NULL;
+}
+
+const char *udev_device_get_devpath(struct udev_device *dev)
+{
+	return dev->devpath;
+}
+
+const char *udev_device_get_syspath(struct udev_device *dev)
+{
+	return dev->syspath;
+}
+
+const char *udev_device_get_action(struct udev_device *dev)
+{
+	return dev->action;
+}
+
+const char *udev_device_get_subsystem(struct udev_device *dev)
+{
+	return "input";
+}
+
+/* Input nodes have no devtype; the daemon only prints it */
+const char *udev_device_get_devtype(struct udev_device *dev)
+{
+	return "";
+}
+
+const char *udev_device_get_property_value(struct udev_device *dev, const char *key)
+{
+	for (struct udev_list_entry *e = dev->parent ? dev->prop : NULL; e; e = e->next) {
+		if (!strcmp(e->name, key))
+			return e->value;
+	}
+	return NULL;
+}
+
+const char *udev_device_get_sysattr_value(struct udev_device *dev, const char *attr)
+{
+	if (!strcmp(attr, "id/vendor"))
+		return dev->vendor;
+	if (!strcmp(attr, "id/product"))
+		return dev->product;
+	return NULL;
+}
+
+struct udev_device *udev_device_get_parent(struct udev_device *dev)
+{
+	return dev->parent;
+}
+
+struct udev_device *udev_device_get_parent_with_subsystem_devtype(struct udev_device *dev,
+								  const char *subsystem, const char *devtype)
+{
+	return dev->parent;
+}
+
+struct udev_device *udev_device_new_from_syspath(struct udev *udev, const char *syspath)
+{
+	return NULL;
+}
+
+struct udev_device *udev_device_unref(struct udev_device *dev)
+{
+	if (dev) {
+		free(dev->parent);
+		free(dev);
+	}
+	return NULL;
+}
+
+struct udev_list_entry *udev_device_get_properties_list_entry(struct udev_device *dev)
+{
+	return dev->parent ? dev->prop : NULL;
+}
+
+struct udev_list_entry *udev_list_entry_get_next(struct udev_list_entry *e)
+{
+	return e->next;
+}
+
+const char *udev_list_entry_get_name(struct udev_list_entry *e)
+{
+	return e->name;
+}
+
+const char *udev_list_entry_get_value(struct udev_list_entry *e)
+{
+	return e->value;
+}
+
+struct udev_enumerate *udev_enumerate_new(struct udev *udev)
+{
+	return &sim_enumerate;
+}
+
+int udev_enumerate_add_match_property(struct udev_enumerate *e, const char *property, const char *value)
+{
+	return 0;
+}
+
+int udev_enumerate_scan_devices(struct udev_enumerate *e)
+{
+	return 0;
+}
+
+struct udev_list_entry *udev_enumerate_get_list_entry(struct udev_enumerate *e)
+{
+	return NULL;
+}
+
+struct udev_enumerate *udev_enumerate_unref(struct udev_enumerate *e)
+{
+	return NULL;
+}
+
+struct udev_monitor *udev_monitor_new_from_netlink(struct udev *udev, const char *name)
+{
+	return &sim_monitor;
+}
+
+int udev_monitor_filter_add_match_subsystem_devtype(struct udev_monitor *m, const char *subsystem, const char *devtype)
+{
+	return 0;
+}
+
+int udev_monitor_enable_receiving(struct udev_monitor *m)
+{
+	return 0;
+}
+
+int udev_monitor_get_fd(struct udev_monitor *m)
+{
+	return m->rfd;
+}
+
+/* One byte in the pipe per queued device keeps level-triggered epoll honest */
+struct udev_device *udev_monitor_receive_device(struct udev_monitor *m)
+{
+	struct udev_device *dev;
+	char byte;
+
+	if (read(m->rfd, &byte, 1) != 1)
+		return NULL;
+	pthread_mutex_lock(&sim_lock);
+	dev = m->queue[m->head++ % 64];
+	pthread_mutex_unlock(&sim_lock);
+	return dev;
+}
+
+static void sim_uevent(struct sim_pad *p, int js, const char *action)
+{
+	struct udev_device *dev = calloc(1, sizeof(*dev));
+	struct udev_device *parent = calloc(1, sizeof(*parent));
+
+	snprintf(parent->syspath, sizeof(parent->syspath), "/sys%s", p->devpath);
+	parent->vendor = "045e";
+	parent->product = "028e";
+	dev->parent = parent;
+	snprintf(dev->devnode, sizeof(dev->devnode), "%s", js ? p->js_node : p->event_node);
+	snprintf(dev->devpath, sizeof(dev->devpath), "%s/%s", p->devpath, strrchr(dev->devnode, '/') + 1);
+	snprintf(dev->syspath, sizeof(dev->syspath), "/sys%s", dev->devpath);
+	snprintf(dev->action, sizeof(dev->action), "%s", action);
+	snprintf(dev->id_path, sizeof(dev->id_path), "%s", p->id_path);
+	dev->prop[0] = (struct udev_list_entry) { "ID_INPUT_JOYSTICK", "1", &dev->prop[1] };
+	dev->prop[1] = (struct udev_list_entry) { "ID_PATH", dev->id_path, &dev->prop[2] };
+	dev->prop[2] = (struct udev_list_entry) { "DEVNAME", dev->devnode, NULL };
+	pthread_mutex_lock(&sim_lock);
+	sim_monitor.queue[sim_monitor.tail++ % 64] = dev;
+	pthread_mutex_unlock(&sim_lock);
+	write(sim_monitor.wfd, "", 1);
+}
+
+/* Simulated nodes */
+static int sim_open_pair(int flags, int *bench_end)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+		return -1;
+	if (flags & O_NONBLOCK)
+		fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	if (sv[0] >= SIM_FDS) {
+		close(sv[0]);
+		close(sv[1]);
+		errno = EMFILE;
+		return -1;
+	}
+	*bench_end = sv[1];
+	return sv[0];
+}
+
+static struct sim_pad *sim_pad_by_node(const char *path, int *js)
+{
+	for (int i = 0; i < SIM_PADS; i++) {
+		if (!strcmp(path, pads[i].js_node)) {
+			*js = 1;
+			return &pads[i];
+		}
+		if (!strcmp(path, pads[i].event_node)) {
+			*js = 0;
+			return &pads[i];
+		}
+	}
+	return NULL;
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	struct sim_pad *p;
+	int fd, js;
+
+	if (flags & O_CREAT) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	if (!strcmp(path, "/dev/uinput")) {
+		struct sim_out *o = calloc(1, sizeof(*o));
+		fd = sim_open_pair(flags, &o->fd);
+		if (fd == -1) {
+			free(o);
+			return -1;
+		}
+		pthread_mutex_lock(&sim_lock);
+		sim_fd[fd].kind = SIM_UINPUT;
+		sim_fd[fd].out = o;
+		o->n = nouts;
+		outs[nouts++] = o;
+		pthread_mutex_unlock(&sim_lock);
+		return fd;
+	}
+	p = sim_pad_by_node(path, &js);
+	if (!p)
+		return syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+	if (!js)
+		lb_sleep_us(cost.open_us);
+	fd = sim_open_pair(flags, js ? &p->js_fd : &p->event_fd);
+	if (fd == -1)
+		return -1;
+	pthread_mutex_lock(&sim_lock);
+	sim_fd[fd].kind = js ? SIM_JS : SIM_EVENT;
+	sim_fd[fd].pad = p;
+	pthread_mutex_unlock(&sim_lock);
+	atomic_fetch_add(&p->opened, 1);
+	return fd;
+}
+
+int stat(const char *restrict path, struct stat *restrict st)
+{
+	int js;
+
+	if (!sim_pad_by_node(path, &js))
+		return syscall(SYS_newfstatat, AT_FDCWD, path, st, 0);
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IFCHR | 0660;
+	return 0;
+}
+
+int chmod(const char *path, mode_t mode)
+{
+	int js;
+
+	if (!sim_pad_by_node(path, &js))
+		return syscall(SYS_fchmodat, AT_FDCWD, path, mode);
+	return 0;
+}
+
+static void set_bit(unsigned char *bits, int bit)
+{
+	bits[bit / 8] |= 1 << (bit % 8);
+}
+
+static int sim_ioctl_js(struct sim_pad *p, unsigned long req, void *arg)
+{
+	if (req == JSIOCGAXES) {
+		*(uint8_t *) arg = SIM_AXES;
+	} else if (req == JSIOCGBUTTONS) {
+		*(uint8_t *) arg = SIM_BUTTONS;
+	} else if (req == JSIOCGAXMAP) {
+		for (int a = 0; a < SIM_AXES; a++)
+			((uint8_t *) arg)[a] = ABS_X + a;
+	} else if (req == JSIOCGBTNMAP) {
+		for (int b = 0; b < SIM_BUTTONS; b++)
+			((uint16_t *) arg)[b] = BTN_SOUTH + b;
+	} else if (_IOC_TYPE(req) == 'j' && _IOC_DIR(req) & _IOC_READ) {
+		memset(arg, 0, _IOC_SIZE(req));
+	}
+	return 0;
+}
+
+static int sim_ioctl_event(struct sim_pad *p, unsigned long req, void *arg)
+{
+	if (req == EVIOCGID) {
+		*(struct input_id *) arg = (struct input_id) { BUS_USB, 0x045e, 0x028e, 0x0110 };
+	} else if (req == EVIOCSFF) {
+		struct ff_effect *e = arg;
+		lb_sleep_us(cost.ff_us);
+		if (e->id == -1)
+			e->id = p->next_id++ % SIM_EFFECTS;
+		atomic_fetch_add(&p->sff, 1);
+	} else if (req == EVIOCRMFF) {
+		lb_sleep_us(cost.ff_us);
+		atomic_fetch_add(&p->rmff, 1);
+	} else if (req == EVIOCGEFFECTS) {
+		*(int *) arg = SIM_EFFECTS;
+	} else if (_IOC_TYPE(req) == 'E' && _IOC_NR(req) == _IOC_NR(EVIOCGNAME(0))) {
+		snprintf(arg, _IOC_SIZE(req), "Simulated Pad");
+	} else if (_IOC_TYPE(req) == 'E' && _IOC_NR(req) >= _IOC_NR(EVIOCGBIT(0, 0)) &&
+		   _IOC_NR(req) < _IOC_NR(EVIOCGBIT(EV_MAX, 0))) {
+		int type = _IOC_NR(req) - _IOC_NR(EVIOCGBIT(0, 0));
+		memset(arg, 0, _IOC_SIZE(req));
+		if (type == EV_KEY) {
+			for (int b = 0; b < SIM_BUTTONS; b++)
+				set_bit(arg, BTN_SOUTH + b);
+		} else if (type == EV_ABS) {
+			for (int a = 0; a < SIM_AXES; a++)
+				set_bit(arg, ABS_X + a);
+		} else if (type == EV_FF) {
+			set_bit(arg, FF_RUMBLE);
+		}
+	} else if (_IOC_TYPE(req) == 'E' && _IOC_NR(req) >= _IOC_NR(EVIOCGABS(0)) &&
+		   _IOC_NR(req) < _IOC_NR(EVIOCGABS(ABS_CNT))) {
+		*(struct input_absinfo *) arg = (struct input_absinfo) { .minimum = -32768, .maximum = 32767 };
+	} else if (_IOC_TYPE(req) == 'E' && _IOC_DIR(req) & _IOC_READ) {
+		memset(arg, 0, _IOC_SIZE(req));
+	}
+	return 0;
+}
+
+static int sim_ioctl_uinput(struct sim_out *o, unsigned long req, void *arg)
+{
+	if (req == UI_DEV_CREATE) {
+		lb_sleep_us(cost.create_us);
+		atomic_store(&o->created, 1);
+	} else if (req == UI_DEV_DESTROY) {
+		atomic_store(&o->created, 0);
+	} else if (req == UI_BEGIN_FF_UPLOAD) {
+		struct uinput_ff_upload *up = arg;
+		up->effect = o->req_effect;
+		up->old = o->effect[o->req_effect.id];
+	} else if (req == UI_END_FF_UPLOAD) {
+		struct uinput_ff_upload *up = arg;
+		o->effect[o->req_effect.id] = o->req_effect;
+		atomic_store(&o->ended, up->request_id);
+	} else if (req == UI_BEGIN_FF_ERASE) {
+		struct uinput_ff_erase *er = arg;
+		er->effect_id = o->req_effect.id;
+	} else if (req == UI_END_FF_ERASE) {
+		struct uinput_ff_erase *er = arg;
+		atomic_store(&o->ended, er->request_id);
+	} else if (req == UI_GET_SYSNAME(64)) {
+		snprintf(arg, 64, "input%d", 1000 + o->n);
+	}
+	return 0;
+}
+
+int ioctl(int fd, unsigned long req, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, req);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+	if (fd < 0 || fd >= SIM_FDS || sim_fd[fd].kind == SIM_NONE)
+		return syscall(SYS_ioctl, fd, req, arg);
+	switch (sim_fd[fd].kind) {
+	case SIM_JS:
+		return sim_ioctl_js(sim_fd[fd].pad, req, arg);
+	case SIM_EVENT:
+		return sim_ioctl_event(sim_fd[fd].pad, req, arg);
+	default:
+		return sim_ioctl_uinput(sim_fd[fd].out, req, arg);
+	}
+}
+
+/* evdev takes EV_FF writes at once, they never fill a buffer */
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	if (fd >= 0 && fd < SIM_FDS && sim_fd[fd].kind == SIM_EVENT) {
+		atomic_fetch_add(&sim_fd[fd].pad->ff_writes, count / sizeof(struct input_event));
+		return count;
+	}
+	return syscall(SYS_write, fd, buf, count);
+}
+
+int close(int fd)
+{
+	if (fd >= 0 && fd < SIM_FDS)
+		sim_fd[fd].kind = SIM_NONE;
+	return syscall(SYS_close, fd);
+}
+
+/* Benchmark side */
+static void sim_pad_init(int i)
+{
+	struct sim_pad *p = &pads[i];
+
+	snprintf(p->js_node, sizeof(p->js_node), "/dev/input/js%d", 40 + i);
+	snprintf(p->event_node, sizeof(p->event_node), "/dev/input/event%d", 40 + i);
+	snprintf(p->devpath, sizeof(p->devpath), "/devices/pci0000:00/0000:00:14.0/usb1/1-%d/input/input%d", i + 1, 400 + i);
+	snprintf(p->id_path, sizeof(p->id_path), "pci-0000:00:14.0-usb-0:%d:1.0", i + 1);
+	p->js_fd = p->event_fd = -1;
+}
+
+static void sim_js_event(struct sim_pad *p, int type, int number, int value)
+{
+	struct js_event e = {
+		.time = lb_now_ns() / 1000000,
+		.value = value,
+		.type = type,
+		.number = number,
+	};
+
+	write(p->js_fd, &e, sizeof(e));
+}
+
+/* Reads frames of a virtual device until an event matches, or the timeout */
+static int sim_wait_event(struct sim_out *o, int type, int code, int value, int timeout_ms)
+{
+	uint64_t deadline = lb_now_ns() + (uint64_t) timeout_ms * 1000000;
+	struct input_event ie;
+
+	for (;;) {
+		struct pollfd pfd = { o->fd, POLLIN, 0 };
+		int64_t left = (int64_t) (deadline - lb_now_ns()) / 1000000;
+		if (left < 0 || poll(&pfd, 1, left + 1) <= 0)
+			return -1;
+		if (read(o->fd, &ie, sizeof(ie)) != sizeof(ie))
+			return -1;
+		if (ie.type == type && ie.code == code && (value == INT_MIN || ie.value == value))
+			return 0;
+	}
+}
+
+/*
+ * Sends a force feedback request the way the uinput core does: an
+ * EV_UINPUT event carrying the request id, answered by the daemon with
+ * UI_BEGIN_* and UI_END_* on its end. Returns the round trip, or -1.
+ */
+static int64_t ff_request(struct sim_out *o, int code, const struct ff_effect *effect)
+{
+	uint64_t start = lb_now_ns(), deadline = start + 1000000000ULL;
+	struct input_event ie;
+	unsigned int seq;
+
+	memset(&ie, 0, sizeof(ie));
+	o->req_code = code;
+	o->req_effect = *effect;
+	seq = atomic_fetch_add(&o->req_seq, 1) + 1;
+	ie.time.tv_sec = start / 1000000000;
+	ie.time.tv_usec = start % 1000000000 / 1000;
+	ie.type = EV_UINPUT;
+	ie.code = code;
+	ie.value = seq;
+	write(o->fd, &ie, sizeof(ie));
+	while (atomic_load(&o->ended) != seq) {
+		if (lb_now_ns() > deadline)
+			return -1;
+		lb_sleep_us(20);
+	}
+	return lb_now_ns() - start;
+}
+
+/* Starts or stops an effect of a virtual device, as a game's EV_FF write */
+static void ff_play_effect(struct sim_out *o, int id, int value)
+{
+	struct input_event ie;
+	uint64_t now = lb_now_ns();
+
+	memset(&ie, 0, sizeof(ie));
+	ie.time.tv_sec = now / 1000000000;
+	ie.time.tv_usec = now % 1000000000 / 1000;
+	ie.type = EV_FF;
+	ie.code = id;
+	ie.value = value;
+	write(o->fd, &ie, sizeof(ie));
+}
+
+static void sim_drain(struct sim_out *o)
+{
+	struct input_event ie[64];
+
+	while (recv(o->fd, ie, sizeof(ie), MSG_DONTWAIT) > 0)
+		;
+}
+
+/* Plugs a pad in; with wait, returns once its virtual device is known */
+static int sim_plug(struct sim_pad *p, int wait)
+{
+	uint64_t deadline = lb_now_ns() + 3000000000ULL;
+
+	sim_uevent(p, 1, "add");
+	sim_uevent(p, 0, "add");
+	if (!wait)
+		return 0;
+	while (atomic_load(&p->opened) < 2 || p->js_fd < 0) {
+		if (lb_now_ns() > deadline)
+			return -1;
+		lb_sleep_us(1000);
+	}
+	/* Press the identifying button until one virtual device reports it */
+	while (!p->out) {
+		if (lb_now_ns() > deadline)
+			return -1;
+		sim_js_event(p, JS_EVENT_BUTTON, SIM_ID_BUTTON, 1);
+		lb_sleep_us(5000);
+		for (int i = 0; i < nouts && !p->out; i++) {
+			struct input_event ie;
+			while (atomic_load(&outs[i]->created) && recv(outs[i]->fd, &ie, sizeof(ie), MSG_DONTWAIT) == sizeof(ie)) {
+				if (ie.type == EV_KEY && ie.code == BTN_SOUTH + SIM_ID_BUTTON && ie.value == 1) {
+					p->out = outs[i];
+					break;
+				}
+			}
+		}
+		sim_js_event(p, JS_EVENT_BUTTON, SIM_ID_BUTTON, 0);
+	}
+	lb_sleep_us(5000);
+	sim_drain(p->out);
+	return 0;
+}
+
+/*
+ * Moves axis 0 of a pad to a value and waits until its virtual device
+ * reports it. Values stay far from rest and never repeat back to back, so
+ * neither the noise filter nor the kernel's duplicate filter drops them.
+ */
+static int64_t sim_probe_ns(struct sim_pad *p, int seq)
+{
+	int value = (seq & 1 ? 20000 : -20000) + seq % 1000;
+	uint64_t start = lb_now_ns();
+
+	sim_js_event(p, JS_EVENT_AXIS, 0, value);
+	if (sim_wait_event(p->out, EV_ABS, ABS_X, value, 1000))
+		return -1;
+	return lb_now_ns() - start;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_latency(const char *what, int64_t *ns, int n)
+{
+	int lost = 0, k = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (ns[i] < 0)
+			lost++;
+		else
+			ns[k++] = ns[i];
+	}
+	qsort(ns, k, sizeof(ns[0]), cmp_i64);
+	if (!k) {
+		fprintf(out, "%-24s %6d probes, all lost\n", what, n);
+		return;
+	}
+	fprintf(out, "%-24s %6d %8.0f %8.0f %8.0f", what, n, ns[k / 2] / 1e3, ns[k * 99 / 100] / 1e3, ns[k - 1] / 1e3);
+	if (lost)
+		fprintf(out, "  %d lost", lost);
+	fprintf(out, "\n");
+}
+
+#define PROBES_MAX 4096
+
+/*
+ * hotplug: pad 0 moves an axis every millisecond, measured from the js
+ * event until its virtual device reports it, first on its own and then
+ * while four more pads are plugged in at once.
+ */
+static int scenario_hotplug(void)
+{
+	static int64_t ns[PROBES_MAX];
+	uint64_t start, end;
+	int n = 0;
+
+	if (sim_plug(&pads[0], 1))
+		return -1;
+	for (int i = 0; i < 200; i++) {
+		ns[i] = sim_probe_ns(&pads[0], i);
+		lb_sleep_us(1000);
+	}
+	fprintf(out, "pad 0 input to output, us  probes   median      p99      max\n");
+	print_latency("idle", ns, 200);
+
+	start = lb_now_ns();
+	for (int i = 1; i <= 4; i++)
+		sim_plug(&pads[i], 0);
+	/* Long enough to cover the settle window and every attach */
+	end = start + 1000000000ULL;
+	while (lb_now_ns() < end && n < PROBES_MAX) {
+		ns[n] = sim_probe_ns(&pads[0], n);
+		n++;
+		lb_sleep_us(1000);
+	}
+	print_latency("4 pads plugged", ns, n);
+	for (int i = 1; i <= 4; i++) {
+		if (atomic_load(&pads[i].opened) < 2)
+			fprintf(out, "pad %d was not attached within 1 s\n", i);
+	}
+	return 0;
+}
+
+/*
+ * rumble: a game uploads one rumble effect, plays it, then changes its
+ * magnitudes every 4 ms, as games do from their frame loop. Counts the
+ * EVIOCSFF and EVIOCRMFF calls that reach the physical pad per update.
+ */
+static int scenario_rumble(void)
+{
+	static int64_t ns[PROBES_MAX];
+	struct sim_pad *p = &pads[0];
+	struct ff_effect effect;
+	int updates = 500, sff, rmff;
+
+	if (sim_plug(p, 1))
+		return -1;
+	memset(&effect, 0, sizeof(effect));
+	effect.type = FF_RUMBLE;
+	effect.id = 0;
+	effect.replay.length = 5000;
+	effect.u.rumble.strong_magnitude = 0x4000;
+	if (ff_request(p->out, UI_FF_UPLOAD, &effect) < 0)
+		return -1;
+	ff_play_effect(p->out, 0, 1);
+	lb_sleep_us(50000);
+	sff = atomic_load(&p->sff);
+	rmff = atomic_load(&p->rmff);
+	for (int i = 0; i < updates; i++) {
+		effect.u.rumble.strong_magnitude = 0x4000 + i * 64;
+		effect.u.rumble.weak_magnitude = 0x8000 - i * 64;
+		ns[i] = ff_request(p->out, UI_FF_UPLOAD, &effect);
+		lb_sleep_us(4000);
+	}
+	/* Let a rate limited update reach the pad */
+	lb_sleep_us(100000);
+	sff = atomic_load(&p->sff) - sff;
+	rmff = atomic_load(&p->rmff) - rmff;
+	fprintf(out, "upload round trip, us     probes   median      p99      max\n");
+	print_latency("magnitude update", ns, updates);
+	fprintf(out, "%d updates: %d EVIOCSFF, %d EVIOCRMFF, %.2f ioctls per update\n",
+		updates, sff, rmff, (double) (sff + rmff) / updates);
+	return 0;
+}
+
+static atomic_int storm_stop;
+
+/* A game on pad 1 rewriting and replaying its rumble as fast as it can */
+static void *storm_thread(void *arg)
+{
+	struct sim_out *o = arg;
+	struct ff_effect effect;
+
+	memset(&effect, 0, sizeof(effect));
+	effect.type = FF_RUMBLE;
+	effect.id = 0;
+	effect.replay.length = 100;
+	for (int i = 0; !atomic_load(&storm_stop); i++) {
+		effect.u.rumble.strong_magnitude = i * 256;
+		if (ff_request(o, UI_FF_UPLOAD, &effect) < 0)
+			break;
+		ff_play_effect(o, 0, 1);
+	}
+	return NULL;
+}
+
+/*
+ * storm: pad 0 moves an axis every millisecond and updates its rumble
+ * every 10 ms, first on its own and then while pad 1 is flooded with
+ * rumble updates. Measures pad 0's input latency and upload round trip.
+ */
+static int scenario_storm(void)
+{
+	static int64_t in_ns[PROBES_MAX], ff_ns[PROBES_MAX];
+	struct ff_effect effect;
+	pthread_t storm;
+
+	if (sim_plug(&pads[0], 1) || sim_plug(&pads[1], 1))
+		return -1;
+	memset(&effect, 0, sizeof(effect));
+	effect.type = FF_RUMBLE;
+	effect.id = 0;
+	effect.replay.length = 100;
+	fprintf(out, "pad 0, us                 probes   median      p99      max\n");
+	for (int phase = 0; phase < 2; phase++) {
+		int n = 0, nff = 0;
+		if (phase && pthread_create(&storm, NULL, storm_thread, pads[1].out))
+			return -1;
+		for (; n < 1000; n++) {
+			in_ns[n] = sim_probe_ns(&pads[0], n);
+			if (n % 10 == 0) {
+				effect.u.rumble.weak_magnitude = n * 32;
+				ff_ns[nff++] = ff_request(pads[0].out, UI_FF_UPLOAD, &effect);
+			}
+			lb_sleep_us(1000);
+		}
+		if (phase) {
+			atomic_store(&storm_stop, 1);
+			pthread_join(storm, NULL);
+		}
+		print_latency(phase ? "input, pad 1 storm" : "input, idle", in_ns, n);
+		print_latency(phase ? "rumble, pad 1 storm" : "rumble, idle", ff_ns, nff);
+	}
+	fprintf(out, "pad 1 EVIOCSFF calls: %d\n", atomic_load(&pads[1].sff));
+	return 0;
+}
+
+/* Output clock of the flood profile, passed to the daemon with -c */
+#define FLOOD_RATE_HZ 125
+#define FLOOD_BUTTON 5
+/* Axis 1 values are spread over this range so each maps back to its send */
+#define FLOOD_VALUES 60001
+
+static atomic_int flood_stop;
+static _Atomic uint64_t flood_sent[FLOOD_VALUES];
+
+/* A stick flooding pad 0: all axes but axis 0 move every 200 us */
+static void *flood_thread(void *arg)
+{
+	struct sim_pad *p = arg;
+
+	for (unsigned int seq = 0; !atomic_load(&flood_stop); seq++) {
+		int value = seq * 7919ULL % FLOOD_VALUES;
+		atomic_store(&flood_sent[value], lb_now_ns());
+		sim_js_event(p, JS_EVENT_AXIS, 1, value - FLOOD_VALUES / 2);
+		for (int a = 2; a < SIM_AXES; a++)
+			sim_js_event(p, JS_EVENT_AXIS, a, (seq & 1 ? 20000 : -20000) + a);
+		lb_sleep_us(200);
+	}
+	return NULL;
+}
+
+/*
+ * flood: pad 0 has an output clock of FLOOD_RATE_HZ and its axes are
+ * flooded, while one of its buttons is toggled every 3 to 11 ms. Measures
+ * each button transition from the js event to its virtual device, and the
+ * age of each axis 1 value the virtual device reports.
+ */
+static int scenario_flood(void)
+{
+	static int64_t key_ns[PROBES_MAX], abs_ns[PROBES_MAX];
+	struct sim_pad *p = &pads[0];
+	uint64_t end, due, pressed = 0;
+	int nkey = 0, nabs = 0, state = 0;
+	pthread_t flood;
+
+	if (sim_plug(p, 1))
+		return -1;
+	if (pthread_create(&flood, NULL, flood_thread, p))
+		return -1;
+	srand(1);
+	lb_sleep_us(100000);
+	sim_drain(p->out);
+	due = lb_now_ns();
+	end = due + 4000000000ULL;
+	while (lb_now_ns() < end && nkey < PROBES_MAX && nabs < PROBES_MAX) {
+		struct input_event ie[64];
+		struct pollfd pfd = { p->out->fd, POLLIN, 0 };
+		uint64_t now = lb_now_ns();
+		ssize_t len;
+
+		if (!pressed && now >= due) {
+			state = !state;
+			pressed = lb_now_ns();
+			sim_js_event(p, JS_EVENT_BUTTON, FLOOD_BUTTON, state);
+		} else if (pressed && now - pressed > 100000000) {
+			key_ns[nkey++] = -1;
+			pressed = 0;
+			due = now;
+		}
+		if (poll(&pfd, 1, 1) <= 0)
+			continue;
+		len = recv(p->out->fd, ie, sizeof(ie), MSG_DONTWAIT);
+		now = lb_now_ns();
+		for (int i = 0; i < len / (ssize_t) sizeof(ie[0]); i++) {
+			if (ie[i].type == EV_KEY && ie[i].code == BTN_SOUTH + FLOOD_BUTTON &&
+			    ie[i].value == state && pressed) {
+				key_ns[nkey++] = now - pressed;
+				pressed = 0;
+				due = now + (3000 + rand() % 8000) * 1000ULL;
+			} else if (ie[i].type == EV_ABS && ie[i].code == ABS_Y && nabs < PROBES_MAX) {
+				int value = ie[i].value + FLOOD_VALUES / 2;
+				if (value >= 0 && value < FLOOD_VALUES)
+					abs_ns[nabs++] = now - atomic_load(&flood_sent[value]);
+			}
+		}
+	}
+	atomic_store(&flood_stop, 1);
+	pthread_join(flood, NULL);
+	fprintf(out, "pad 0 at %d Hz, us         probes   median      p99      max\n", FLOOD_RATE_HZ);
+	print_latency("button, axis flood", key_ns, nkey);
+	print_latency("axis, axis flood", abs_ns, nabs);
+	return 0;
+}
+
+static void *daemon_thread(void *arg)
+{
+	char **argv = arg;
+	int argc = 0;
+
+	while (argv[argc])
+		argc++;
+	exit(dup_joysticks_main(argc, argv));
+	return NULL;
+}
+
+static void lb_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options] <scenario> [-- daemon options]\n", name);
+	fprintf(stderr, "Scenarios:\n");
+	fprintf(stderr, "  hotplug     input latency of one pad while four more are plugged in\n");
+	fprintf(stderr, "  rumble      physical ioctls per rumble magnitude update\n");
+	fprintf(stderr, "  storm       input and rumble latency of one pad while another is flooded with rumble\n");
+	fprintf(stderr, "  flood       button and axis latency of one pad with an output clock under an axis flood\n");
+	fprintf(stderr, "Options, modeled device costs in microseconds:\n");
+	fprintf(stderr, "  -o <us>     opening an event node (default %d)\n", cost.open_us);
+	fprintf(stderr, "  -c <us>     UI_DEV_CREATE (default %d)\n", cost.create_us);
+	fprintf(stderr, "  -f <us>     EVIOCSFF and EVIOCRMFF (default %d)\n", cost.ff_us);
+}
+
+int main(int argc, char *argv[])
+{
+	static char *daemon_argv[64] = { "dup-joysticks" };
+	static char flood_conf[] = "/tmp/load-bench-XXXXXX";
+	const char *scenario;
+	pthread_t daemon;
+	int opt, pipefd[2], ret, nargs = 1;
+
+	while ((opt = getopt(argc, argv, "+o:c:f:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			cost.open_us = atoi(optarg);
+			break;
+		case 'c':
+			cost.create_us = atoi(optarg);
+			break;
+		case 'f':
+			cost.ff_us = atoi(optarg);
+			break;
+		default:
+			lb_usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+	if (optind >= argc) {
+		lb_usage(argv[0]);
+		return 1;
+	}
+	scenario = argv[optind++];
+	if (optind < argc && !strcmp(argv[optind], "--"))
+		optind++;
+	/* flood runs under a profile with an output clock; a later -c wins */
+	if (!strcmp(scenario, "flood")) {
+		int fd = mkstemp(flood_conf);
+		if (fd == -1 || dprintf(fd, "[profile flood]\nrate %d\n", FLOOD_RATE_HZ) < 0) {
+			perror(flood_conf);
+			return 1;
+		}
+		close(fd);
+		daemon_argv[nargs++] = "-c";
+		daemon_argv[nargs++] = flood_conf;
+	}
+	while (optind < argc && nargs < 63)
+		daemon_argv[nargs++] = argv[optind++];
+	optind = 1;
+
+	/* The daemon's messages go to /dev/null, results to stdout */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		perror("stdout");
+		return 1;
+	}
+	setvbuf(out, NULL, _IOLBF, 0);
+	if (pipe(pipefd) == -1) {
+		perror("pipe");
+		return 1;
+	}
+	fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+	sim_monitor.rfd = pipefd[0];
+	sim_monitor.wfd = pipefd[1];
+	for (int i = 0; i < SIM_PADS; i++)
+		sim_pad_init(i);
+
+	fprintf(out, "Modeled costs: event node open %d us, UI_DEV_CREATE %d us, EVIOCSFF/EVIOCRMFF %d us\n",
+		cost.open_us, cost.create_us, cost.ff_us);
+	if (pthread_create(&daemon, NULL, daemon_thread, daemon_argv)) {
+		fprintf(stderr, "Can't start the daemon\n");
+		return 1;
+	}
+	if (!strcmp(scenario, "hotplug")) {
+		ret = scenario_hotplug();
+	} else if (!strcmp(scenario, "rumble")) {
+		ret = scenario_rumble();
+	} else if (!strcmp(scenario, "storm")) {
+		ret = scenario_storm();
+	} else if (!strcmp(scenario, "flood")) {
+		ret = scenario_flood();
+	} else {
+		lb_usage(argv[0]);
+		_exit(1);
+	}
+	if (ret)
+		fprintf(out, "A pad was not attached in time\n");
+	if (!strcmp(scenario, "flood"))
+		unlink(flood_conf);
+	fflush(out);
+	_exit(ret ? 1 : 0);
+}
@@ -0,0 +1,355 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 Scott Moreau <oreaus@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// gcc -o pair-test pair-test.c -ludev -lpthread
+
+/*
+ * Pairing test for dup-joysticks.
+ *
+ * Builds the daemon into this program and feeds add_joystick() and
+ * pending_remove_node() synthetic udev devices, so the jsN/eventN pairing
+ * is checked without hardware or root: identical pads without ID_PATH,
+ * interleaved adds, a half removed before or after its partner arrived,
+ * the settle window, lookups past removed entries and a full table. The
+ * udev calls add_joystick() makes are answered by this file and take
+ * precedence over libudev's.
+ *
+ * It then times pairing itself, from the first half's add event until
+ * the pair is queued for the attach worker, with the settle window off
+ * and with other halves waiting. Opening and creating the devices is not
+ * included; ff-bench measures the daemon with real nodes.
+ *
+ *	./pair-test
+ */
+
+#define main dup_joysticks_main
+#include "dup-joysticks.c"
+#undef main
+
+struct udev_device {
+	const char *devnode;
+	const char *syspath;
+	const char *id_path;
+	struct udev_device *parent;
+};
+
+const char *udev_device_get_devnode(struct udev_device *dev)
+{
+	return dev->devnode;
+}
+
+const char *udev_device_get_syspath(struct udev_device *dev)
+{
+	return dev->syspath;
+}
+
+const char *udev_device_get_property_value(struct udev_device *dev, const char *key)
+{
+	return !strcmp(key, "ID_PATH") ? dev->id_path : NULL;
+}
+
+struct udev_device *udev_device_get_parent_with_subsystem_devtype(struct udev_device *dev,
+								  const char *subsystem, const char *devtype)
+{
+	return dev->parent;
+}
+
+/* One input device and its two nodes */
+struct pad {
+	char syspath[64], js_node[32], event_node[32];
+	struct udev_device input, js, event;
+};
+
+static FILE *out;
+static int failures;
+
+static void pad_init(struct pad *p, int input, int js, int event, const char *id_path)
+{
+	snprintf(p->syspath, sizeof(p->syspath), "/sys/devices/virtual/input/input%d", input);
+	snprintf(p->js_node, sizeof(p->js_node), "/dev/input/js%d", js);
+	snprintf(p->event_node, sizeof(p->event_node), "/dev/input/event%d", event);
+	p->input = (struct udev_device) { .syspath = p->syspath };
+	p->js = (struct udev_device) { .devnode = p->js_node, .id_path = id_path, .parent = &p->input };
+	p->event = (struct udev_device) { .devnode = p->event_node, .id_path = id_path, .parent = &p->input };
+}
+
+static void check(int ok, const char *what)
+{
+	fprintf(out, "%s: %s\n", ok ? "ok" : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+static int pending_count(void)
+{
+	int n = 0;
+
+	for (int i = 0; i < PENDING_SLOTS; i++)
+		n += !!pending[i].key;
+	return n;
+}
+
+/* Takes the next queued attach back from the worker's ring, -1 if none */
+static int take_attach(void)
+{
+	int slot;
+
+	return ring_pop(&attach_requests, &slot) ? -1 : slot;
+}
+
+static int attached(int slot, const struct pad *p)
+{
+	const struct joystick_cold *cold = joysticks[slot].cold;
+
+	return joysticks[slot].state == JS_PROBING && cold->node_name && cold->event_node_name &&
+		!strcmp(cold->node_name, p->js_node) && !strcmp(cold->event_node_name, p->event_node);
+}
+
+static void release_slot(int slot)
+{
+	struct joystick_cold *cold = joysticks[slot].cold;
+
+	arena_free(cold->node_name);
+	arena_free(cold->event_node_name);
+	arena_free(cold->id_path);
+	cold->node_name = cold->event_node_name = cold->id_path = NULL;
+	joysticks[slot].state = JS_FREE;
+}
+
+/* Attaches what is due and releases it again, returns how many there were */
+static int drain_attaches(void)
+{
+	int n = 0, slot;
+
+	while ((slot = take_attach()) >= 0) {
+		release_slot(slot);
+		n++;
+	}
+	return n;
+}
+
+static void test_identical_pads(void)
+{
+	struct pad a, b;
+	int s0, s1;
+
+	/* Same model on one hub: nothing but the input parent tells them apart */
+	pad_init(&a, 5, 0, 10, NULL);
+	pad_init(&b, 6, 1, 11, NULL);
+	add_joystick(&a.js);
+	add_joystick(&b.js);
+	add_joystick(&b.event);
+	add_joystick(&a.event);
+	pending_service(1);
+	s0 = take_attach();
+	s1 = take_attach();
+	check(s0 >= 0 && s1 >= 0 && take_attach() < 0, "two identical pads without ID_PATH attach once each");
+	check(s0 >= 0 && s1 >= 0 && (attached(s0, &a) || attached(s1, &a)) && (attached(s0, &b) || attached(s1, &b)),
+	      "interleaved halves pair by input parent");
+	if (s0 >= 0)
+		release_slot(s0);
+	if (s1 >= 0)
+		release_slot(s1);
+	check(!pending_count(), "attached pairs leave the table");
+}
+
+static void test_settle(void)
+{
+	struct pad a;
+	int settle = cfg.settle_ms;
+
+	cfg.settle_ms = 50;
+	pad_init(&a, 7, 2, 12, "pci-0000:00:14.0-usb-0:2:1.0");
+	add_joystick(&a.js);
+	add_joystick(&a.event);
+	pending_service(0);
+	check(take_attach() < 0, "a complete pair waits for the settle window");
+	usleep(30000);
+	/* A further event for the device restarts the window */
+	add_joystick(&a.js);
+	usleep(30000);
+	pending_service(0);
+	check(take_attach() < 0, "an add event during the window restarts it");
+	usleep(30000);
+	pending_service(0);
+	int slot = take_attach();
+	check(slot >= 0 && attached(slot, &a) && joysticks[slot].cold->id_path &&
+	      !strcmp(joysticks[slot].cold->id_path, a.js.id_path), "the pair attaches once settled, with its ID_PATH");
+	if (slot >= 0)
+		release_slot(slot);
+	cfg.settle_ms = settle;
+}
+
+static void test_removed_halves(void)
+{
+	struct pad a, b;
+
+	pad_init(&a, 8, 3, 13, NULL);
+	add_joystick(&a.js);
+	pending_remove_node(a.js_node);
+	check(!pending_count(), "a lone half removed before its partner leaves the table");
+	add_joystick(&a.event);
+	pending_service(1);
+	check(take_attach() < 0 && pending_count() == 1, "the partner arriving afterwards waits alone");
+	for (int i = 0; i < PENDING_SLOTS; i++) {
+		if (pending[i].key)
+			pending[i].seen_us = now_us() - PENDING_TIMEOUT_US;
+	}
+	pending_service(0);
+	check(!pending_count() && take_attach() < 0, "an unpaired half is dropped after the timeout");
+
+	pad_init(&b, 9, 4, 14, NULL);
+	add_joystick(&b.js);
+	add_joystick(&b.event);
+	pending_remove_node(b.event_node);
+	pending_service(1);
+	check(take_attach() < 0 && pending_count() == 1, "a pair losing a half is not attached");
+	add_joystick(&b.event);
+	pending_service(1);
+	int slot = take_attach();
+	check(slot >= 0 && attached(slot, &b), "the pair attaches once the half is back");
+	if (slot >= 0)
+		release_slot(slot);
+}
+
+static void test_tombstones(void)
+{
+	static struct pad churn[PENDING_SLOTS];
+	struct pad a;
+
+	/* Every slot has held an entry, so lookups run past removed ones */
+	for (int round = 0; round < 3; round++) {
+		for (int i = 0; i < PENDING_SLOTS; i++) {
+			pad_init(&churn[i], 100 + i, 100 + i, 200 + i, NULL);
+			add_joystick(&churn[i].js);
+		}
+		for (int i = 0; i < PENDING_SLOTS; i++)
+			pending_remove_node(churn[i].js_node);
+	}
+	pad_init(&a, 10, 5, 15, NULL);
+	add_joystick(&a.js);
+	for (int i = 0; i < PENDING_SLOTS - 1; i++) {
+		add_joystick(&churn[i].event);
+		pending_remove_node(churn[i].event_node);
+	}
+	add_joystick(&a.event);
+	check(pending_count() == 1, "both halves find the same entry past removed ones");
+	pending_service(1);
+	int slot = take_attach();
+	check(slot >= 0 && attached(slot, &a), "the pair attaches after table churn");
+	if (slot >= 0)
+		release_slot(slot);
+}
+
+static void test_full_table(void)
+{
+	static struct pad many[PENDING_SLOTS + 1];
+	struct udev_device orphan = { .devnode = "/dev/input/js9" };
+
+	for (int i = 0; i <= PENDING_SLOTS; i++) {
+		pad_init(&many[i], 300 + i, 300 + i, 400 + i, NULL);
+		add_joystick(&many[i].js);
+	}
+	check(pending_count() == PENDING_SLOTS, "halves beyond the table size are refused");
+	for (int i = 0; i <= PENDING_SLOTS; i++)
+		pending_remove_node(many[i].js_node);
+	check(!pending_count(), "the full table drains");
+	add_joystick(&orphan);
+	check(!pending_count(), "a node without an input parent is ignored");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+#define LATENCY_RUNS 2000
+
+/* First add event of a pair until it is queued, with busy other halves waiting */
+static void pairing_latency(int busy)
+{
+	static struct pad others[PENDING_SLOTS], a;
+	static uint64_t ns[LATENCY_RUNS];
+
+	for (int i = 0; i < busy; i++) {
+		pad_init(&others[i], 500 + i, 500 + i, 600 + i, NULL);
+		add_joystick(&others[i].js);
+	}
+	pad_init(&a, 11, 6, 16, NULL);
+	for (int r = 0; r < LATENCY_RUNS; r++) {
+		uint64_t start = bench_ns();
+		add_joystick(&a.js);
+		add_joystick(&a.event);
+		pending_service(0);
+		ns[r] = bench_ns() - start;
+		if (drain_attaches() != 1) {
+			check(0, "pairing latency run attached its pair");
+			break;
+		}
+	}
+	for (int i = 0; i < busy; i++)
+		pending_remove_node(others[i].js_node);
+	qsort(ns, LATENCY_RUNS, sizeof(ns[0]), cmp_u64);
+	fprintf(out, "%6d %10lu %10lu %10lu\n", busy, (unsigned long) ns[LATENCY_RUNS / 2],
+		(unsigned long) ns[LATENCY_RUNS * 99 / 100], (unsigned long) ns[LATENCY_RUNS - 1]);
+}
+
+int main(void)
+{
+	int settle = cfg.settle_ms;
+
+	/* The daemon's own messages go to /dev/null, results to stdout */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		perror("stdout");
+		return 1;
+	}
+	setvbuf(out, NULL, _IOLBF, 0);
+	arena_init();
+	for (int i = 0; i < MAX_JOYSTICKS; i++) {
+		joysticks[i].cold = &joystick_cold[i];
+		pthread_mutex_init(&joysticks[i].cold->ff_lock, NULL);
+		joysticks[i].tick_fd = -1;
+	}
+
+	test_identical_pads();
+	test_settle();
+	test_removed_halves();
+	test_tombstones();
+	test_full_table();
+
+	cfg.settle_ms = 0;
+	fprintf(out, "Pairing latency, ns from the first add event until queued, %d runs\n", LATENCY_RUNS);
+	fprintf(out, "  busy     median        p99        max\n");
+	pairing_latency(0);
+	pairing_latency(PENDING_SLOTS / 2);
+	pairing_latency(PENDING_SLOTS - 1);
+	cfg.settle_ms = settle;
+	fprintf(out, "The settle window (-s, default %d ms) is added to every attach\n", settle);
+
+	fprintf(out, "%d failed\n", failures);
+	return !!failures;
+}